@@ -0,0 +1,108 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * response cache for read-only APDUs
+ *
+ * Records are packed into one arena of SIZE bytes in insertion order, the oldest are
+ * dropped when a new one does not fit. Key: lane, logical channel, a context value
+ * identifying the selection on that channel, and the command bytes. Lookup is a linear
+ * scan, the arena holds a few dozen responses at most.
+ *
+ * record: lane(1) chan(1) ctx(4) cmd len(2) rsp len(2) cmd rsp
+ */
+
+#ifndef _H_APDUCACHE_
+#define _H_APDUCACHE_
+
+#include <stdint.h>
+#include <string.h>
+
+namespace seccid {
+
+template<uint32_t SIZE>
+class APDUCache {
+	static constexpr uint32_t HDR = 10;
+
+	uint8_t arena[SIZE ? SIZE : 1];
+	uint32_t used = 0;
+
+	static uint16_t u16(const uint8_t *p) {
+		return p[0] | (p[1] << 8);
+	}
+	static uint32_t size(const uint8_t *r) {
+		return HDR + u16(&r[6]) + u16(&r[8]);
+	}
+	void drop(uint32_t off) {
+		const uint32_t n = size(&arena[off]);
+		memmove(&arena[off], &arena[off + n], used - off - n);
+		used -= n;
+	}
+public:
+	uint32_t hits = 0, misses = 0;
+
+	uint32_t fill() const {
+		return used;
+	}
+
+	// response of an identical command, NULL: not cached
+	const uint8_t* find(uint8_t lane, uint8_t chan, uint32_t ctx, const uint8_t *cmd, uint16_t len, uint16_t &rspLen) {
+		for (uint32_t off = 0; off < used; off += size(&arena[off])) {
+			const uint8_t *r = &arena[off];
+			if (r[0] == lane && r[1] == chan && !memcmp(&r[2], &ctx, 4) && u16(&r[6]) == len
+					&& !memcmp(&r[HDR], cmd, len)) {
+				hits++;
+				rspLen = u16(&r[8]);
+				return &r[HDR + len];
+			}
+		}
+		misses++;
+		return NULL;
+	}
+
+	void store(uint8_t lane, uint8_t chan, uint32_t ctx, const uint8_t *cmd, uint16_t len, const uint8_t *rsp,
+			uint16_t rspLen) {
+		const uint32_t n = HDR + len + rspLen;
+		if (n > SIZE)
+			return;
+		while (used + n > SIZE)
+			drop(0);
+		uint8_t *r = &arena[used];
+		r[0] = lane, r[1] = chan;
+		memcpy(&r[2], &ctx, 4);
+		r[6] = len, r[7] = len >> 8, r[8] = rspLen, r[9] = rspLen >> 8;
+		memcpy(&r[HDR], cmd, len);
+		memcpy(&r[HDR + len], rsp, rspLen);
+		used += n;
+	}
+
+	// records of a lane, all for -1
+	void flush(int16_t lane = -1) {
+		if (lane < 0)
+			used = 0;
+		for (uint32_t off = 0; off < used;) {
+			if (arena[off] == lane)
+				drop(off);
+			else
+				off += size(&arena[off]);
+		}
+	}
+};
+
+} // end namespace
+
+#endif
@@ -17,6 +17,8 @@
 
 #include "Arduino.h"
 #include "ccid.h"
+#include "spsc.h"
+#include "stats.h"
 
 #include "tusb.h"
 #include "device/usbd.h"
@@ -33,6 +35,15 @@ typedef struct {
 	uint8_t itf_num;
 	uint8_t ep_in;
 	uint8_t ep_out;
+	uint8_t ep_notif;
+	bool notify_all;	// report every present slot as changed, e.g. after configuration
+
+	uint8_t *rx_msg;	// destination of the message being received, NULL: discard
+	uint32_t rx_len;	// bytes received of the current message
+	uint32_t rx_end;	// header + payload length once the header is parsed, 0 otherwise
+	uint16_t rx_direct;	// bytes of an OUT transfer armed straight into rx_msg
+	uint16_t tx_len;	// IN transfer sent straight from a message buffer, 0: none
+	bool tx_zlp;		// message is a multiple of the packet size, terminate with a ZLP
 
 	tu_fifo_t rx_ff;	// nothing is cleared on reset from here on
 	tu_fifo_t tx_ff;
@@ -44,6 +55,7 @@ typedef struct {
 
 	CFG_TUSB_MEM_ALIGN uint8_t epout_buf[CFG_TUD_CCID_EP_BUFSIZE];
 	CFG_TUSB_MEM_ALIGN uint8_t epin_buf[CFG_TUD_CCID_EP_BUFSIZE];
+	CFG_TUSB_MEM_ALIGN uint8_t epnotif_buf[CCID_NOTIFY_SZ];
 } ccidd_interface_t;
 
 #define ITF_MEM_RESET_SIZE offsetof(ccidd_interface_t, rx_ff)
@@ -63,16 +75,20 @@ SECCID_USBD_CCID::SECCID_USBD_CCID(void) {
 }
 
 uint16_t SECCID_USBD_CCID::getInterfaceDescriptor(uint8_t itfnum_deprecated, uint8_t *buf, uint16_t bufsize) {
-	uint8_t itfnum = 0, strid = 0, ep_in = 0, ep_out = 0;
+	uint8_t itfnum = 0, strid = 0, ep_in = 0, ep_out = 0, ep_notif = 0;
 	(void) itfnum_deprecated;
 
 	if (buf) { // null buffer is used to get the length of descriptor only
 		itfnum = TinyUSBDevice.allocInterface(1);
 		ep_in = TinyUSBDevice.allocEndpoint(TUSB_DIR_IN);
 		ep_out = TinyUSBDevice.allocEndpoint(TUSB_DIR_OUT);
+#if CFG_TUD_CCID_NOTIFY
+		ep_notif = TinyUSBDevice.allocEndpoint(TUSB_DIR_IN);
+#endif
 	}
+	(void) ep_notif;
 
-	uint8_t desc[] = { TUD_CCID_DESCRIPTOR(itfnum, _strid, ep_out, ep_in, CFG_TUD_CCID_EP_BUFSIZE) };
+	uint8_t desc[] = { TUD_CCID_DESCRIPTOR(itfnum, _strid, ep_notif, ep_out, ep_in, CFG_TUD_CCID_EP_BUFSIZE) };
 	uint16_t const len = sizeof(desc);
 
 	if (buf) {
@@ -115,6 +131,18 @@ void SECCID_USBD_CCID::end(void) {
 //--------------------------------------------------------------------+
 static void _prep_out_transaction(ccidd_interface_t *p_itf) {
 	uint8_t const rhport = 0;
+
+	// payload of the current message: receive whole packets in place, the last one goes through the FIFO
+	// as it may carry the start of the next message
+	uint32_t direct = p_itf->rx_msg && p_itf->rx_end ? p_itf->rx_end - p_itf->rx_len : 0;
+	direct -= direct % CFG_TUD_CCID_EP_BUFSIZE;
+	if (direct && !tu_fifo_count(&p_itf->rx_ff)) {
+		TU_VERIFY(usbd_edpt_claim(rhport, p_itf->ep_out),);
+		p_itf->rx_direct = direct;
+		usbd_edpt_xfer(rhport, p_itf->ep_out, &p_itf->rx_msg[p_itf->rx_len], direct);
+		return;
+	}
+
 	uint16_t available = tu_fifo_remaining(&p_itf->rx_ff);
 
 	TU_VERIFY(available >= sizeof(p_itf->epout_buf),); // This pre-check reduces endpoint claiming
@@ -157,12 +185,31 @@ static uint32_t tud_ccid_write_n_flush(ccidd_interface_t *p_itf) {
 	}
 }
 
+// send a complete message as one multi-packet transfer straight from buffer, which must stay untouched
+// until tud_ccid_n_xfer_busy() returns false. Fails while the endpoint or the TX FIFO are in use.
+bool tud_ccid_n_xfer(uint8_t itf, uint8_t *buffer, uint16_t len) {
+	ccidd_interface_t *p_itf = &_ccidd_itf[itf];
+	uint8_t const rhport = 0;
+	TU_VERIFY(p_itf->ep_in && len && !p_itf->tx_len && !tu_fifo_count(&p_itf->tx_ff));
+	TU_VERIFY(usbd_edpt_claim(rhport, p_itf->ep_in));
+
+	p_itf->tx_len = len;
+	p_itf->tx_zlp = !(len % CFG_TUD_CCID_EP_BUFSIZE);
+	TU_ASSERT(usbd_edpt_xfer(rhport, p_itf->ep_in, buffer, len));
+	return true;
+}
+
+bool tud_ccid_n_xfer_busy(uint8_t itf) {
+	return _ccidd_itf[itf].tx_len != 0;
+}
+
 uint32_t tud_ccid_n_write(uint8_t itf, void *buffer, uint32_t bufsize) {
 	ccidd_interface_t *p_itf = &_ccidd_itf[itf];
 	TU_VERIFY(p_itf->ep_in);
 
 	uint16_t ret = tu_fifo_write_n(&p_itf->tx_ff, buffer, bufsize);
-	return tud_ccid_write_n_flush(p_itf) > 0 ? ret : 0;
+	tud_ccid_write_n_flush(p_itf); // queued data is sent on transfer completion if the endpoint is busy
+	return ret;
 }
 
 //--------------------------------------------------------------------+
@@ -246,7 +293,15 @@ uint16_t ccid_open(uint8_t rhport, tusb_desc_interface_t const *itf_desc, uint16
 	//------------- Endpoint Descriptor -------------//
 	p_desc = tu_desc_next(p_desc);
 	uint8_t numEp = itf_desc->bNumEndpoints;
-	TU_ASSERT(usbd_open_edpt_pair(rhport, p_desc, numEp, TUSB_XFER_BULK, &p_itf->ep_out, &p_itf->ep_in), 0);
+	TU_ASSERT(numEp >= 2 && usbd_open_edpt_pair(rhport, p_desc, 2, TUSB_XFER_BULK, &p_itf->ep_out, &p_itf->ep_in), 0);
+	p_desc = tu_desc_next(tu_desc_next(p_desc));
+	if (numEp > 2) { // notifications
+		tusb_desc_endpoint_t const *desc_ep = (tusb_desc_endpoint_t const*) p_desc;
+		TU_ASSERT(TUSB_DESC_ENDPOINT == desc_ep->bDescriptorType && TUSB_XFER_INTERRUPT == desc_ep->bmAttributes.xfer, 0);
+		TU_ASSERT(usbd_edpt_open(rhport, desc_ep), 0);
+		p_itf->ep_notif = desc_ep->bEndpointAddress;
+		p_itf->notify_all = true;
+	}
 	drv_len += numEp * sizeof(tusb_desc_endpoint_t);
 
 	if (p_itf->ep_out) {
@@ -260,8 +315,58 @@ uint16_t ccid_open(uint8_t rhport, tusb_desc_interface_t const *itf_desc, uint16
 	return drv_len;
 }
 
+// abort handshake per slot: the control request (core 0) is passed to core 1, which answers the queued
+// XfrBlocks, cancels the running ones and acknowledges. run() answers PC_to_RDR_Abort afterwards.
+std::atomic<uint8_t> abortReq[CFG_TUD_CCID_SLOTS], abortDone[CFG_TUD_CCID_SLOTS];
+uint32_t abortCtrl = 0, abortBulk = 0; // core 0: requests received per slot
+uint8_t abortSeq[CFG_TUD_CCID_SLOTS]; // bSeq of PC_to_RDR_Abort
+std::atomic<uint32_t> slotClock[CFG_TUD_CCID_SLOTS]; // Hz, 0: default
+
+void tud_ccid_n_slot_clock(const uint8_t itf, uint8_t slot, uint32_t hz) {
+	(void) itf;
+	slotClock[slot].store(hz, std::memory_order_relaxed);
+}
+
+// historical bytes of the ATR per slot, seqlock: odd while core 1 writes, ICC_POWER_ON reads again on a change
+uint8_t slotHb[CFG_TUD_CCID_SLOTS][15], slotHbLen[CFG_TUD_CCID_SLOTS];
+std::atomic<uint8_t> slotHbSeq[CFG_TUD_CCID_SLOTS];
+
+void tud_ccid_n_slot_atr(const uint8_t itf, uint8_t slot, const uint8_t *hb, uint8_t len) {
+	(void) itf;
+	const uint8_t seq = slotHbSeq[slot].load(std::memory_order_relaxed);
+	slotHbSeq[slot].store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slotHbLen[slot] = len < sizeof(slotHb[slot]) ? len : sizeof(slotHb[slot]);
+	memcpy(slotHb[slot], hb, slotHbLen[slot]);
+	slotHbSeq[slot].store(seq + 2, std::memory_order_release);
+}
+
 bool ccid_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request) {
-	return false; // no control transfers supported
+	if (stage != CONTROL_STAGE_SETUP)
+		return true;
+	TU_VERIFY(request->bmRequestType_bit.type == TUSB_REQ_TYPE_CLASS
+			&& request->bmRequestType_bit.recipient == TUSB_REQ_RCPT_INTERFACE);
+
+	static uint32_t rates[CFG_TUD_CCID_SLOTS]; // stays valid through the data stage
+	switch (request->bRequest) {
+	case REQ_ABORT: { // wValue: bSeq, bSlot
+		const uint8_t slot = request->wValue & 0xFF;
+		TU_VERIFY(slot < CFG_TUD_CCID_SLOTS);
+		abortCtrl |= 1 << slot;
+		abortReq[slot].store(abortReq[slot].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		return tud_control_status(rhport, request);
+	}
+	case REQ_GET_CLOCK_FREQUENCIES: // kHz, one entry per slot
+	case REQ_GET_DATA_RATES: // bit/s
+		for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++) {
+			const uint32_t hz = slotClock[slot].load(std::memory_order_relaxed);
+			const uint32_t khz = hz ? hz / 1000 : CCID_CLOCK_KHZ;
+			rates[slot] = request->bRequest == REQ_GET_CLOCK_FREQUENCIES ? khz : CCID_DATA_RATE(khz);
+		}
+		return tud_control_xfer(rhport, request, rates, request->wLength < sizeof(rates) ? request->wLength : sizeof(rates));
+	default:
+		return false;
+	}
 }
 
 bool ccid_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes) {
@@ -273,19 +378,35 @@ bool ccid_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_
 
 	for (itf = 0; itf < CFG_TUD_CCID; itf++) { // Identify which interface to use
 		p_itf = &_ccidd_itf[itf];
-		if ((ep_addr == p_itf->ep_out) || (ep_addr == p_itf->ep_in))
+		if ((ep_addr == p_itf->ep_out) || (ep_addr == p_itf->ep_in) || (ep_addr == p_itf->ep_notif))
 			break;
 	}
 	TU_ASSERT(itf < CFG_TUD_CCID);
 
+	if (ep_addr == p_itf->ep_notif) // notification sent, run() sends the next one
+		return true;
+
 	if (ep_addr == p_itf->ep_out) { // receive new data
-		tu_fifo_write_n(&p_itf->rx_ff, p_itf->epout_buf, (uint16_t) xferred_bytes);
+		if (p_itf->rx_direct) { // payload received in place
+			p_itf->rx_len += xferred_bytes;
+			p_itf->rx_direct = 0;
+		} else {
+			tu_fifo_write_n(&p_itf->rx_ff, p_itf->epout_buf, (uint16_t) xferred_bytes);
+		}
 
 		if (tud_ccid_rx_cb) // invoke receive callback if available
 			tud_ccid_rx_cb(itf);
 
 		_prep_out_transaction(p_itf); // prepare for next
 	} else if (ep_addr == p_itf->ep_in) {
+		if (p_itf->tx_len) { // message sent in place, the host expects a short packet at its end
+			if (p_itf->tx_zlp) {
+				p_itf->tx_zlp = false;
+				TU_ASSERT(usbd_edpt_xfer(rhport, p_itf->ep_in, NULL, 0));
+				return true;
+			}
+			p_itf->tx_len = 0;
+		}
 		if (tud_ccid_tx_cb)
 			tud_ccid_tx_cb(itf, (uint16_t) xferred_bytes);
 
@@ -319,6 +440,18 @@ SECCID_USBD_CCID::apdu_callback_t SECCID_USBD_CCID::set_apdu_callback(SECCID_USB
 	return old_cb;
 }
 
+SECCID_USBD_CCID::dispatch_callback_t SECCID_USBD_CCID::set_dispatch_callback(SECCID_USBD_CCID::dispatch_callback_t new_cb) {
+	dispatch_callback_t old_cb = dcb;
+	dcb = new_cb;
+	return old_cb;
+}
+
+SECCID_USBD_CCID::abort_callback_t SECCID_USBD_CCID::set_abort_callback(SECCID_USBD_CCID::abort_callback_t new_cb) {
+	abort_callback_t old_cb = acb;
+	acb = new_cb;
+	return old_cb;
+}
+
 /**
  * convenience runner for CCID interface
  *
@@ -326,83 +459,378 @@ SECCID_USBD_CCID::apdu_callback_t SECCID_USBD_CCID::set_apdu_callback(SECCID_USB
 
 uint8_t ccid_in[CCID_MSGLEN];
 
-void _process(const uint8_t itf, SECCID_USBD_CCID::apdu_callback_t cb) {
-	const ccidd_interface_t *ccid = &_ccidd_itf[itf];
+// XfrBlocks are executed on core 1: jobs and completed responses are passed as buffer indices,
+// the response is built in place of the command. Buffers complete out of order when several CCID
+// slots are busy, core 0 owns the free mask, the sending state and the time extension timers.
+uint8_t ccid_xfr[CFG_TUD_CCID_XFR_DEPTH][CCID_MSGLEN];
+seccid::SPSC<uint8_t, CFG_TUD_CCID_XFR_DEPTH> xfrJobs, xfrDone;
+uint32_t xfrFree = (1 << CFG_TUD_CCID_XFR_DEPTH) - 1;
+uint32_t xfrExt[CFG_TUD_CCID_XFR_DEPTH]; // millis() of queueing or the last time extension, per buffer
+uint8_t xfrSending = 0xFF; // buffer whose response is being sent
+uint32_t xfrRxAt[CFG_TUD_CCID_XFR_DEPTH], xfrQueuedAt[CFG_TUD_CCID_XFR_DEPTH], xfrDoneAt[CFG_TUD_CCID_XFR_DEPTH]; // micros()
+uint32_t xfrSentAt = 0; // micros() the last response was sent, 0: none yet
+
+// core 1 only: jobs per CCID slot, started in order, the lanes currently executing and those that
+// already ran a job while another lane waits
+seccid::SPSC<uint8_t, CFG_TUD_CCID_XFR_DEPTH> slotJobs[CFG_TUD_CCID_SLOTS];
+uint32_t laneBusy = 0, laneLent = 0, slotLanes[CFG_TUD_CCID_SLOTS]; // slotLanes: lanes executing a slot's jobs
+
+// slot state, single writer per slot: ICC present in bit 0 and a change count above, hardware errors
+// counted with the bSeq of the failed XfrBlock. Core 0 keeps what the host was notified of.
+std::atomic<uint8_t> iccState[CFG_TUD_CCID_SLOTS], hwErrors[CFG_TUD_CCID_SLOTS];
+uint8_t hwErrSeq[CFG_TUD_CCID_SLOTS];
+uint8_t iccNotified[CFG_TUD_CCID_SLOTS], hwErrNotified[CFG_TUD_CCID_SLOTS];
+std::atomic<uint8_t> iccPower[CFG_TUD_CCID_SLOTS]; // IccPowerOn / IccPowerOff received, core 0
+
+static bool _present(uint8_t slot) {
+	return !(iccState[slot].load(std::memory_order_relaxed) & 1); // bit set: no ICC, present from boot on
+}
 
-	uint8_t *rdBuf = ccid_in;
-	uint32_t rdLen = tud_ccid_n_read(itf, rdBuf, sizeof(ccid_in));
+uint8_t tud_ccid_n_slot_power(const uint8_t itf, uint8_t slot) {
+	(void) itf;
+	return iccPower[slot].load(std::memory_order_acquire);
+}
 
-	while (rdLen) {
-		while (rdLen < CCID_HDR_SZ /* || message length / max ccid_in length */) {
-			rdLen += tud_ccid_n_read(itf, &rdBuf[rdLen], sizeof(ccid_in) - rdLen);
-		}
+void tud_ccid_n_slot_changed(const uint8_t itf, uint8_t slot, bool present, bool changed) {
+	(void) itf;
+	const uint8_t s = iccState[slot].load(std::memory_order_relaxed);
+	const uint8_t n = ((s + (changed << 1)) & ~1) | !present;
+	if (n != s)
+		iccState[slot].store(n, std::memory_order_release);
+}
 
-		ccid_msg_t *msg = (ccid_msg_t*) rdBuf;
-		uint8_t *p = msg->data;
-		rdLen -= (CCID_HDR_SZ + msg->length);
-		rdBuf += (CCID_HDR_SZ + msg->length);
-
-		uint32_t wrLen = 0;
-
-		switch (msg->type) {
-		case ICC_POWER_ON: {
-			msg->type = DATA_BLOCK;
-			msg->status = msg->error = msg->param = 0;  // status, error, clock
-			p[wrLen++] = 0x3B; // maybe make this configurable
-			p[wrLen++] = 0x80;
-			p[wrLen++] = 0x01;
-			p[wrLen++] = 0x81;
-			break;
+static void _write(const uint8_t itf, uint8_t *p, uint32_t wrLen) {
+	for (uint32_t n = 0; wrLen > 0; wrLen -= n, p += n) {
+		n = tud_ccid_n_write(itf, p, wrLen);
+		yield();
+	}
+}
+
+static void _reply(const uint8_t itf, ccid_msg_t *msg) { // queued behind a response sent in place
+	_write(itf, (uint8_t*) msg, CCID_HDR_SZ + msg->length);
+}
+
+static void _message(const uint8_t itf, ccid_msg_t *msg) { // complete message, payload in ccid_in or an XfrBlock buffer
+	uint8_t *p = msg->data;
+	uint32_t wrLen = 0;
+
+	if (msg->slot >= CFG_TUD_CCID_SLOTS) { // no such slot, an XfrBlock buffer stays free
+		msg->type = msg->type == XFR_BLOCK || msg->type == ICC_POWER_ON ? DATA_BLOCK : SLOT_STATUS;
+		msg->length = msg->param = 0;
+		msg->status = SLOT_STATUS_FAILED | SLOT_STATUS_NO_ICC;
+		msg->error = CMD_BAD_SLOT;
+		_reply(itf, msg);
+		return;
+	}
+
+	if (msg->type == ICC_POWER_ON || msg->type == ICC_POWER_OFF) // ends the host's card session
+		iccPower[msg->slot].store(iccPower[msg->slot].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+	switch (msg->type) {
+	case ICC_POWER_ON: {
+		msg->type = DATA_BLOCK;
+		msg->status = msg->error = msg->param = 0;  // status, error, clock
+		// TS, T0 (TD1, K historical bytes), TD1 (T=1), historical bytes of the CIP, TCK. 3B 80 01 81 until the SE is attached
+		uint8_t seq, k;
+		do {
+			seq = slotHbSeq[msg->slot].load(std::memory_order_acquire);
+			k = slotHbLen[msg->slot];
+			memcpy(&p[3], slotHb[msg->slot], k);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while ((seq & 1) || seq != slotHbSeq[msg->slot].load(std::memory_order_relaxed));
+		p[wrLen++] = 0x3B;
+		p[wrLen++] = 0x80 | k;
+		p[wrLen++] = 0x01;
+		wrLen += k;
+		uint8_t tck = 0;
+		for (uint32_t i = 1; i < wrLen; i++)
+			tck ^= p[i];
+		p[wrLen++] = tck;
+		break;
+	}
+	case ICC_POWER_OFF: // no operation
+	case GET_SLOT_STATUS: {
+		msg->type = SLOT_STATUS;
+		msg->status = _present(msg->slot) ? SLOT_STATUS_OK : SLOT_STATUS_NO_ICC;
+		msg->error = msg->param = 0;  // clock
+		break;
+	}
+	case XFR_BLOCK: {
+		if ((uint8_t*) msg != ccid_in) { // received into a free buffer, executed on core 1, answered by run()
+			const uint8_t buf = ((uint8_t*) msg - ccid_xfr[0]) / CCID_MSGLEN;
+			xfrFree &= ~(1 << buf);
+			xfrExt[buf] = millis();
+			xfrQueuedAt[buf] = micros();
+			seccid::stats.stage(seccid::STAGE_USB_RX, xfrQueuedAt[buf] - xfrRxAt[buf]);
+			xfrJobs.push(buf);
+			return;
 		}
-		case ICC_POWER_OFF: // no operation
-		case GET_SLOT_STATUS: {
-			msg->type = SLOT_STATUS;
-			msg->status = msg->error = msg->param = 0;  // clock
-			break;
+		msg->type = DATA_BLOCK;
+		msg->status = SLOT_STATUS_FAILED;
+		msg->error = CMD_SLOT_BUSY;
+		msg->param = 0;
+		break;
+	}
+	case ABORT: // answered by run() once the control request arrived and the slot's XfrBlocks are answered
+		abortSeq[msg->slot] = msg->seq;
+		abortBulk |= 1 << msg->slot;
+		return;
+	case GET_PARAMETERS:
+	case RESET_PARAMETERS:
+	case SET_PARAMETERS: {
+		msg->type = PARAMETERS;
+		msg->length = msg->status = msg->error = 0;
+		msg->param = 0x01; // protocol num
+		break;
+	}
+	default:
+		msg->type = SLOT_STATUS;
+		msg->length = msg->error = msg->param = 0; // clock
+		msg->status = SLOT_STATUS_FAILED; // status: failed
+		break;
+
+	}
+
+	msg->length = wrLen;
+	_reply(itf, msg);
+}
+
+// incremental parser, runs on every bulk OUT transfer until the RX FIFO is empty: the header is
+// collected in ccid_in, the payload is read directly into an XfrBlock slot or behind the header.
+// Full packets of the payload are received in place by the driver (rx_direct).
+void _process(const uint8_t itf) {
+	ccidd_interface_t *p_itf = &_ccidd_itf[itf];
+	ccid_msg_t *hdr = (ccid_msg_t*) ccid_in;
+	uint32_t n;
+
+	for (;;) {
+		if (p_itf->rx_len < CCID_HDR_SZ) {
+			if (!(n = tu_fifo_read_n(&p_itf->rx_ff, &ccid_in[p_itf->rx_len], CCID_HDR_SZ - p_itf->rx_len)))
+				return;
+			if ((p_itf->rx_len += n) < CCID_HDR_SZ)
+				continue;
+
+			if (hdr->length > CCID_IFSD) {
+				p_itf->rx_msg = NULL;
+			} else if (hdr->type == XFR_BLOCK && xfrFree) {
+				const uint8_t buf = __builtin_ctz(xfrFree);
+				p_itf->rx_msg = ccid_xfr[buf];
+				memcpy(p_itf->rx_msg, ccid_in, CCID_HDR_SZ);
+				xfrRxAt[buf] = micros();
+				if (xfrSentAt && xfrFree == (1 << CFG_TUD_CCID_XFR_DEPTH) - 1) // the host had nothing outstanding
+					seccid::stats.stage(seccid::STAGE_HOST, xfrRxAt[buf] - xfrSentAt);
+			} else {
+				p_itf->rx_msg = ccid_in;
+			}
+			p_itf->rx_end = CCID_HDR_SZ + hdr->length;
 		}
-		case XFR_BLOCK: {
-			msg->type = DATA_BLOCK;
 
-			int32_t res = cb ? cb(p, msg->length) : -1;
-			if (res < 0) {
-				msg->status = SLOT_STATUS_FAILED;
-				msg->error = -res;
+		uint32_t left = p_itf->rx_end - p_itf->rx_len;
+		if (left) {
+			uint8_t tmp[CFG_TUD_CCID_EP_BUFSIZE];
+			if (p_itf->rx_msg) {
+				n = tu_fifo_read_n(&p_itf->rx_ff, &p_itf->rx_msg[p_itf->rx_len], left);
 			} else {
-				wrLen = res;
-				msg->status = msg->error = msg->param = 0;
+				n = tu_fifo_read_n(&p_itf->rx_ff, tmp, left < sizeof(tmp) ? left : sizeof(tmp));
 			}
-			break;
+			if (!n)
+				return;
+			if ((p_itf->rx_len += n) < p_itf->rx_end)
+				continue;
 		}
-		case GET_PARAMETERS:
-		case RESET_PARAMETERS:
-		case SET_PARAMETERS: {
-			msg->type = PARAMETERS;
-			msg->length = msg->status = msg->error = 0;
-			msg->param = 0x01; // protocol num
-			break;
+
+		ccid_msg_t *msg = (ccid_msg_t*) p_itf->rx_msg;
+		p_itf->rx_len = p_itf->rx_end = 0;
+		if (!msg) { // oversized, payload discarded: bError is the offset of dwLength
+			msg = hdr;
+			msg->type = msg->type == XFR_BLOCK ? DATA_BLOCK : SLOT_STATUS;
+			msg->length = msg->param = 0;
+			msg->status = SLOT_STATUS_FAILED;
+			msg->error = 1;
+			_reply(itf, msg);
+			continue;
 		}
-		default:
-			msg->type = SLOT_STATUS;
-			msg->length = msg->error = msg->param = 0; // clock
-			msg->status = SLOT_STATUS_FAILED; // status: failed
-			break;
+		_message(itf, msg);
+	}
+}
 
+static void _complete(uint8_t buf, int32_t res) { // response in place of the XfrBlock, sent by run()
+	ccid_msg_t *msg = (ccid_msg_t*) ccid_xfr[buf];
+	uint32_t wrLen = 0;
+
+	msg->type = DATA_BLOCK;
+	if (res < 0) {
+		msg->status = SLOT_STATUS_FAILED;
+		msg->error = -res;
+		if (res == -HW_ERROR) { // reported on the notification endpoint as well
+			hwErrSeq[msg->slot] = msg->seq;
+			hwErrors[msg->slot].store(hwErrors[msg->slot].load(std::memory_order_relaxed) + 1, std::memory_order_release);
 		}
+	} else {
+		wrLen = res;
+		msg->status = msg->error = msg->param = 0;
+	}
+	msg->length = wrLen;
+
+	xfrDoneAt[buf] = micros();
+	xfrDone.push(buf);
+}
 
-		msg->length = wrLen;
-		p = (uint8_t*) msg;
-		wrLen += CCID_HDR_SZ;
-		for (uint32_t n = 0; wrLen > 0; wrLen -= n, p += n) {
-			n = tud_ccid_n_write(itf, p, wrLen);
-			yield();
+// runs each slot's next job to completion on an idle lane. Called again from the wait callback of a
+// secure element, jobs execute on other lanes while that one computes: busy lanes are skipped, each
+// lane runs one job per wait, and the dispatch callback declines jobs that would outlast the wait:
+// the waiting lane is not polled again before a nested job has completed.
+void _execute(SECCID_USBD_CCID::apdu_callback_t cb, SECCID_USBD_CCID::dispatch_callback_t dcb,
+		SECCID_USBD_CCID::abort_callback_t acb) {
+	const bool nested = laneBusy != 0;
+	uint8_t buf;
+	while (xfrJobs.pop(buf))
+		slotJobs[((ccid_msg_t*) ccid_xfr[buf])->slot].push(buf);
+
+	for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++) { // aborted by the host
+		const uint8_t req = abortReq[slot].load(std::memory_order_acquire);
+		if (req == abortDone[slot].load(std::memory_order_relaxed))
+			continue;
+		while (slotJobs[slot].pop(buf))
+			_complete(buf, -CMD_ABORTED);
+		for (uint8_t lane = 0; acb && lane < CFG_TUD_CCID_LANES; lane++)
+			if (slotLanes[slot] & (1 << lane))
+				acb(lane);
+		abortDone[slot].store(req, std::memory_order_release);
+	}
+
+	for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++) {
+		if (!slotJobs[slot].peek(buf))
+			continue;
+
+		ccid_msg_t *msg = (ccid_msg_t*) ccid_xfr[buf];
+		const int8_t lane = dcb ? dcb(slot, msg->data, msg->length, laneBusy | laneLent) : slot;
+		if (lane < 0 || ((laneBusy | laneLent) & (1 << lane)))
+			continue;
+		slotJobs[slot].pop(buf);
+
+		if (nested)
+			laneLent |= 1 << lane;
+		laneBusy |= 1 << lane;
+		slotLanes[slot] |= 1 << lane;
+		const uint32_t t = micros();
+		seccid::stats.stage(seccid::STAGE_QUEUE, t - xfrQueuedAt[buf]);
+		int32_t res = cb ? cb(lane, msg->data, msg->length) : -1;
+		seccid::stats.stage(seccid::STAGE_EXEC, micros() - t);
+		slotLanes[slot] &= ~(1 << lane);
+		laneBusy &= ~(1 << lane);
+		if (!nested)
+			laneLent = 0;
+
+		_complete(buf, res);
+	}
+}
+
+// one notification per interrupt transfer: pending hardware errors first, then the slots that changed
+static void _notify(const uint8_t itf) {
+	ccidd_interface_t *p_itf = &_ccidd_itf[itf];
+	uint8_t const rhport = 0;
+	if (!p_itf->ep_notif || !usbd_edpt_claim(rhport, p_itf->ep_notif)) // previous one not sent yet
+		return;
+
+	uint8_t *p = p_itf->epnotif_buf;
+	uint16_t len = 0;
+	for (uint8_t slot = 0; !len && slot < CFG_TUD_CCID_SLOTS; slot++) {
+		const uint8_t n = hwErrors[slot].load(std::memory_order_acquire);
+		if (n != hwErrNotified[slot]) {
+			p[len++] = HARDWARE_ERROR;
+			p[len++] = slot;
+			p[len++] = hwErrSeq[slot];
+			p[len++] = HWERR_SE_LOST;
+			hwErrNotified[slot] = n;
+		}
+	}
+
+	if (!len) { // bmSlotICCState: two bits per slot, ICC present and changed
+		bool changed = false;
+		memset(p, 0, 1 + (CFG_TUD_CCID_SLOTS + 3) / 4);
+		p[0] = NOTIFY_SLOT_CHANGE;
+		for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++) {
+			const uint8_t s = iccState[slot].load(std::memory_order_acquire);
+			const bool c = p_itf->notify_all ? !(s & 1) : s != iccNotified[slot];
+			p[1 + slot / 4] |= ((s & 1 ? 0 : 1) | (c << 1)) << (slot % 4 * 2);
+			changed |= c;
+			iccNotified[slot] = s;
 		}
+		p_itf->notify_all = false;
+		if (changed)
+			len = 1 + (CFG_TUD_CCID_SLOTS + 3) / 4;
 	}
 
-	return;
+	if (len)
+		usbd_edpt_xfer(rhport, p_itf->ep_notif, p, len);
+	else
+		usbd_edpt_release(rhport, p_itf->ep_notif);
+}
+
+void _run(const uint8_t itf) {
+	_notify(itf);
+
+	for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++) { // abort handshake complete, XfrBlocks of the slot answered
+		if (!(abortCtrl & abortBulk & (1 << slot))
+				|| abortDone[slot].load(std::memory_order_acquire) != abortReq[slot].load(std::memory_order_relaxed))
+			continue;
+		bool pending = false;
+		for (uint8_t buf = 0; buf < CFG_TUD_CCID_XFR_DEPTH; buf++)
+			pending |= !(xfrFree & (1 << buf)) && ((const ccid_msg_t*) ccid_xfr[buf])->slot == slot;
+		if (pending)
+			continue;
+		uint8_t rsp[CCID_HDR_SZ] = { SLOT_STATUS, 0, 0, 0, 0, slot, abortSeq[slot], 0, 0, 0 };
+		rsp[7] = _present(slot) ? SLOT_STATUS_OK : SLOT_STATUS_NO_ICC;
+		_write(itf, rsp, sizeof(rsp));
+		abortCtrl &= ~(1 << slot);
+		abortBulk &= ~(1 << slot);
+	}
+
+	if (xfrSending != 0xFF && !tud_ccid_n_xfer_busy(itf)) { // response sent, buffer is free again
+		xfrSentAt = micros();
+		seccid::stats.stage(seccid::STAGE_USB_TX, xfrSentAt - xfrDoneAt[xfrSending]);
+		seccid::stats.stage(seccid::STAGE_TOTAL, xfrSentAt - xfrRxAt[xfrSending]);
+		xfrFree |= 1 << xfrSending;
+		xfrSending = 0xFF;
+	}
+
+	uint8_t buf;
+	if (xfrSending == 0xFF && xfrDone.peek(buf)) { // one multi-packet IN transfer from the buffer
+		ccid_msg_t *msg = (ccid_msg_t*) ccid_xfr[buf];
+		if (tud_ccid_n_xfer(itf, (uint8_t*) msg, CCID_HDR_SZ + msg->length)) {
+			xfrDone.pop(buf);
+			xfrSending = buf;
+		}
+	}
+
+	for (buf = 0; xfrSending == 0xFF && buf < CFG_TUD_CCID_XFR_DEPTH; buf++) { // still executing
+		if ((xfrFree & (1 << buf)) || millis() - xfrExt[buf] < CFG_TUD_CCID_TIMEEXT_MS)
+			continue;
+		const ccid_msg_t *msg = (const ccid_msg_t*) ccid_xfr[buf]; // slot and seq are not touched by core 1
+		uint8_t ext[CCID_HDR_SZ] = { DATA_BLOCK, 0, 0, 0, 0, msg->slot, msg->seq, SLOT_STATUS_TIMEEXT, 1 /* BWT multiplier */, 0 };
+		_write(itf, ext, sizeof(ext));
+		xfrExt[buf] = millis();
+	}
 }
 
 void SECCID_USBD_CCID::process() {
 	const uint8_t itf = _instance;
-	_process(itf, cb);
+	_process(itf);
 }
 
+void SECCID_USBD_CCID::run() {
+	const uint8_t itf = _instance;
+	_run(itf);
+}
+
+void SECCID_USBD_CCID::execute() {
+	_execute(cb, dcb, acb);
+}
+
+bool SECCID_USBD_CCID::idle() {
+	for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++)
+		if (slotJobs[slot].count())
+			return false;
+	return !laneBusy && !xfrJobs.count();
+}
@@ -27,9 +27,21 @@
 #define CFG_TUD_CCID_RX_BUFSIZE	(256)
 #define CFG_TUD_CCID_TX_BUFSIZE	(256)
 
+#define CFG_TUD_CCID_TIMEEXT_MS	(500) // interval of time extension requests while an XfrBlock is executed
+#define CFG_TUD_CCID_XFR_DEPTH	(4) // XfrBlocks queued for / executed on core 1, power of two
+#ifndef CFG_TUD_CCID_SLOTS
+#define CFG_TUD_CCID_SLOTS		(2) // slots, one secure element each, busy concurrently
+#endif
+#define CFG_TUD_CCID_LANES		CFG_TUD_CCID_SLOTS // secure elements executing concurrently
+#ifndef CFG_TUD_CCID_NOTIFY
+#define CFG_TUD_CCID_NOTIFY		(1) // interrupt IN endpoint for NotifySlotChange / HardwareError, the host need not poll
+#endif
+#define CFG_TUD_CCID_NOTIFY_MS	(16) // bInterval of the interrupt endpoint
+
 #define CCID_HDR_SZ				(10) // CCID message header size
 #define CCID_DESC_SZ			(54) // CCID function descriptor size
 #define CCID_DESC_TYPE_CCID		(0x21) // CCID Descriptor
+#define CCID_NOTIFY_SZ			(8) // interrupt endpoint size, NotifySlotChange for up to 28 slots
 
 #define CCID_VERSION			(0x0110)
 #define CCID_IFSD				(1024)
@@ -37,25 +49,40 @@
 #define CCID_MSGLEN				(CCID_IFSD + CCID_HDR_SZ)
 #define CCID_CLAGET				(0xFF)
 #define CCID_CLAENV				(0xFF)
+#define CCID_CLOCK_KHZ			(400) // default I2C clock, actual clocks per slot by GET_CLOCK_FREQUENCIES
+#define CCID_MAX_CLOCK_KHZ		(1000)
+#define CCID_DATA_RATE(_khz)	((_khz) * 8000u / 9) // bit/s, 9 clocks per byte with ACK
+
+#if CFG_TUD_CCID_NOTIFY
+#define CCID_NUM_EP				(3)
+#define TUD_CCID_NOTIFY_EP(_epnotif) ,\
+  /* Endpoint Notification */\
+  7, TUSB_DESC_ENDPOINT, _epnotif, TUSB_XFER_INTERRUPT, U16_TO_U8S_LE(CCID_NOTIFY_SZ), CFG_TUD_CCID_NOTIFY_MS
+#else
+#define CCID_NUM_EP				(2)
+#define TUD_CCID_NOTIFY_EP(_epnotif)
+#endif
 
 // CCID Descriptor Template
-// Interface number, string index, EP notification address and size, EP data address (out, in) and size.
-#define TUD_CCID_DESCRIPTOR(_itfnum, _stridx, _epout, _epin, _epsize) \
+// Interface number, string index, EP notification address, EP data address (out, in) and size.
+#define TUD_CCID_DESCRIPTOR(_itfnum, _stridx, _epnotif, _epout, _epin, _epsize) \
   /* CCID Interface */\
-  9, TUSB_DESC_INTERFACE, _itfnum, 0, 2, TUSB_CLASS_SMART_CARD, 0, 0, _stridx,\
+  9, TUSB_DESC_INTERFACE, _itfnum, 0, CCID_NUM_EP, TUSB_CLASS_SMART_CARD, 0, 0, _stridx,\
   /* CCID Function, version, max slot index, supported voltages and protocols */\
-  CCID_DESC_SZ, CCID_DESC_TYPE_CCID, U16_TO_U8S_LE(CCID_VERSION), 0, 0x7, U32_TO_U8S_LE(3),\
+  CCID_DESC_SZ, CCID_DESC_TYPE_CCID, U16_TO_U8S_LE(CCID_VERSION), CFG_TUD_CCID_SLOTS - 1, 0x7, U32_TO_U8S_LE(3),\
   /* default clock, maximum clock, num clocks, current datarate, max datarate */\
-  U32_TO_U8S_LE(4000), U32_TO_U8S_LE(5000), 0, U32_TO_U8S_LE(9600), U32_TO_U8S_LE(625000),\
+  U32_TO_U8S_LE(CCID_CLOCK_KHZ), U32_TO_U8S_LE(CCID_MAX_CLOCK_KHZ), CFG_TUD_CCID_SLOTS,\
+  U32_TO_U8S_LE(CCID_DATA_RATE(CCID_CLOCK_KHZ)), U32_TO_U8S_LE(CCID_DATA_RATE(CCID_MAX_CLOCK_KHZ)),\
   /* num datarates, max IFSD, sync. protocols, mechanical, features */\
-  0, U32_TO_U8S_LE(CCID_IFSD), U32_TO_U8S_LE(0), U32_TO_U8S_LE(0), U32_TO_U8S_LE(CCID_FEATURES),\
+  CFG_TUD_CCID_SLOTS, U32_TO_U8S_LE(CCID_IFSD), U32_TO_U8S_LE(0), U32_TO_U8S_LE(0), U32_TO_U8S_LE(CCID_FEATURES),\
   /* max msg len, get response CLA, envelope CLA, LCD layout, PIN support, max busy slots */\
-  U32_TO_U8S_LE(CCID_MSGLEN), CCID_CLAGET, CCID_CLAENV, U16_TO_U8S_LE(0), 0, 1,\
+  U32_TO_U8S_LE(CCID_MSGLEN), CCID_CLAGET, CCID_CLAENV, U16_TO_U8S_LE(0), 0, CFG_TUD_CCID_SLOTS,\
   \
   /* Endpoint Out */\
   7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,\
   /* Endpoint In */\
   7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0\
+  TUD_CCID_NOTIFY_EP(_epnotif)
 
 // CCID reqests
 #define ICC_POWER_ON		(0x62)
@@ -65,15 +92,36 @@
 #define GET_PARAMETERS		(0x6C)
 #define RESET_PARAMETERS	(0x6D)
 #define SET_PARAMETERS		(0x61)
+#define ABORT				(0x72)
+
+// CCID class specific control requests
+#define REQ_ABORT					(0x01)
+#define REQ_GET_CLOCK_FREQUENCIES	(0x02)
+#define REQ_GET_DATA_RATES			(0x03)
 
 // CCID responses
 #define DATA_BLOCK			(0x80)
 #define SLOT_STATUS			(0x81)
 #define PARAMETERS			(0x82)
 
+// CCID notifications
+#define NOTIFY_SLOT_CHANGE	(0x50)
+#define HARDWARE_ERROR		(0x51)
+#define HWERR_SE_LOST		(0x80) // vendor specific bHardwareErrorCode: SE beyond recovery
+
 // status values
 #define SLOT_STATUS_OK		(0)
 #define SLOT_STATUS_FAILED	(1 << 6)
+#define SLOT_STATUS_TIMEEXT	(2 << 6)
+#define SLOT_STATUS_NO_ICC	(2) // bmICCStatus
+
+// slot errors
+#define CMD_BAD_SLOT		(5) // offset of bSlot
+#define CMD_SLOT_BUSY		(0xE0)
+#define CMD_ABORTED			(0xFF)
+#define HW_ERROR			(0xFB)
+#define XFR_PARITY_ERROR	(0xFD)
+#define ICC_MUTE			(0xFE)
 
 // do not modify
 #pragma scalar_storage_order little-endian
@@ -104,10 +152,20 @@ public:
 	static uint8_t getInstanceCount(void);
 	void end(void);
 
-	typedef uint32_t (*apdu_callback_t)(uint8_t*, uint32_t);
+	typedef uint32_t (*apdu_callback_t)(uint8_t lane, uint8_t*, uint32_t);
 	apdu_callback_t set_apdu_callback(apdu_callback_t);
-
-	void process();
+	// picks the lane (secure element) an XfrBlock of a slot executes on, -1: none of the suitable is free yet, or
+	// the XfrBlock would hold up the lanes busy meanwhile. Without one, each slot is its own lane.
+	typedef int8_t (*dispatch_callback_t)(uint8_t slot, uint8_t*, uint32_t, uint32_t busyLanes);
+	dispatch_callback_t set_dispatch_callback(dispatch_callback_t);
+	// the host aborted the XfrBlock executing on a lane: end it early, it may still complete normally
+	typedef void (*abort_callback_t)(uint8_t lane);
+	abort_callback_t set_abort_callback(abort_callback_t);
+
+	void process(); // USB receive callback: parse messages, answer status requests, queue XfrBlocks
+	void run(); // core 0, call from loop(): send responses of executed XfrBlocks and time extensions
+	void execute(); // core 1, call from loop1() and while waiting for a secure element: execute XfrBlocks on idle lanes
+	bool idle(); // core 1: no XfrBlock queued or executing
 
 private:
 	enum {
@@ -122,6 +180,8 @@ private:
 	}
 
 	apdu_callback_t cb;
+	dispatch_callback_t dcb;
+	abort_callback_t acb;
 };
 
 #endif
@@ -130,3 +190,13 @@ private:
 
 TU_ATTR_WEAK void tud_ccid_rx_cb(uint8_t itf);
 TU_ATTR_WEAK void tud_ccid_tx_cb(uint8_t itf, uint16_t xferred_bytes);
+
+// ICC presence of a slot, reported by GET_SLOT_STATUS and NotifySlotChange. changed: the ICC was reset or
+// replaced. Any core, one caller per slot.
+void tud_ccid_n_slot_changed(uint8_t itf, uint8_t slot, bool present, bool changed);
+// IccPowerOn / IccPowerOff count of a slot, a change ends the host's card session. Any core.
+uint8_t tud_ccid_n_slot_power(uint8_t itf, uint8_t slot);
+// bus clock of a slot's ICC, reported by GET_CLOCK_FREQUENCIES and GET_DATA_RATES
+void tud_ccid_n_slot_clock(uint8_t itf, uint8_t slot, uint32_t hz);
+// historical bytes of a slot's ICC (CIP), up to 15, sent in the ATR of IccPowerOn. Any core, one caller per slot.
+void tud_ccid_n_slot_atr(uint8_t itf, uint8_t slot, const uint8_t *hb, uint8_t len);
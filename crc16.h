@@ -0,0 +1,126 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * CRC-16/X-25 (reflected CCITT polynomial 0x8408, init 0xFFFF, complemented) as used by T=1'
+ *
+ * SLICES selects speed vs. table size at compile time, tables are generated constexpr:
+ *   0  nibble table,    32 bytes, two lookups per byte
+ *   1  byte table,     512 bytes, one lookup per byte
+ *   4  slice-by-4,    2048 bytes, four bytes per step
+ *   8  slice-by-8,    4096 bytes, eight bytes per step
+ *
+ * CRC16 is incremental: update() with blocks as they are built or come off the bus,
+ * copy() moves bytes and updates the CRC in the same pass. host/crcbench compares the
+ * variants.
+ */
+
+#ifndef _H_CRC16_
+#define _H_CRC16_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CRC16_SLICES
+#define CRC16_SLICES (1)
+#endif
+
+namespace seccid {
+
+template<unsigned SLICES>
+struct CRC16Tables {
+	static constexpr unsigned ROWS = SLICES ? SLICES : 1, COLS = SLICES ? 256 : 16;
+	uint16_t t[ROWS][COLS];
+
+	constexpr CRC16Tables() :
+			t() {
+		for (unsigned i = 0; i < COLS; i++) { // row 0: one byte (or nibble) through the register
+			uint16_t crc = i;
+			for (unsigned bit = 0; bit < (SLICES ? 8 : 4); bit++)
+				crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+			t[0][i] = crc;
+		}
+		for (unsigned k = 1; k < ROWS; k++) // row k: byte followed by k zero bytes
+			for (unsigned i = 0; i < COLS; i++)
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+	}
+};
+
+template<unsigned SLICES = CRC16_SLICES>
+class CRC16 {
+	static_assert(SLICES == 0 || SLICES == 1 || SLICES == 4 || SLICES == 8, "CRC16: 0, 1, 4 or 8 slices");
+	static constexpr CRC16Tables<SLICES> tables { };
+
+	uint16_t crc;
+
+	static inline uint16_t step(uint16_t crc, uint8_t b) {
+		const auto &t = tables.t[0];
+		if constexpr (SLICES) {
+			return t[(crc ^ b) & 0xFF] ^ (crc >> 8);
+		}
+		crc = t[(crc ^ b) & 0x0F] ^ (crc >> 4);
+		return t[(crc ^ (b >> 4)) & 0x0F] ^ (crc >> 4);
+	}
+public:
+	constexpr CRC16(uint16_t init = 0xFFFF) :
+			crc(init) {
+	}
+
+	CRC16& update(uint8_t b) {
+		crc = step(crc, b);
+		return *this;
+	}
+
+	CRC16& update(const uint8_t *p, size_t len) {
+		const auto &t = tables.t;
+		if constexpr (SLICES >= 4) {
+			for (; len >= SLICES; len -= SLICES, p += SLICES) {
+				const uint16_t c = crc ^ (p[0] | (p[1] << 8));
+				uint16_t r = t[SLICES - 1][c & 0xFF] ^ t[SLICES - 2][c >> 8];
+				for (unsigned k = 2; k < SLICES; k++)
+					r ^= t[SLICES - 1 - k][p[k]];
+				crc = r;
+			}
+		}
+		while (len--)
+			crc = step(crc, *p++);
+		return *this;
+	}
+
+	// copy and update in one pass
+	CRC16& copy(uint8_t *dst, const uint8_t *src, size_t len) {
+		while (len--)
+			crc = step(crc, *dst++ = *src++);
+		return *this;
+	}
+
+	uint16_t value() const { // register, e.g. to continue later
+		return crc;
+	}
+
+	uint16_t final() const { // as transmitted by T=1', MSB first
+		return ~crc;
+	}
+
+	static uint16_t compute(const uint8_t *p, size_t len) {
+		return CRC16().update(p, len).final();
+	}
+};
+
+} // end namespace
+
+#endif
@@ -15,168 +15,457 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "crc16.h"
 #include "gpi2c.h"
+#include "stats.h"
+#include "trace.h"
 
 //namespace kisses { // keep it small & simple embedded security
 namespace seccid { // secure element CCID
 
-const uint16_t crcTable[256] = { /**/
-0x0000, 0x1189, 0x2312, 0x329B, 0x4624, 0x57AD, 0x6536, 0x74BF, /**/
-0x8C48, 0x9DC1, 0xAF5A, 0xBED3, 0xCA6C, 0xDBE5, 0xE97E, 0xF8F7, /**/
-0x1081, 0x0108, 0x3393, 0x221A, 0x56A5, 0x472C, 0x75B7, 0x643E, /**/
-0x9CC9, 0x8D40, 0xBFDB, 0xAE52, 0xDAED, 0xCB64, 0xF9FF, 0xE876, /**/
-0x2102, 0x308B, 0x0210, 0x1399, 0x6726, 0x76AF, 0x4434, 0x55BD, /**/
-0xAD4A, 0xBCC3, 0x8E58, 0x9FD1, 0xEB6E, 0xFAE7, 0xC87C, 0xD9F5, /**/
-0x3183, 0x200A, 0x1291, 0x0318, 0x77A7, 0x662E, 0x54B5, 0x453C, /**/
-0xBDCB, 0xAC42, 0x9ED9, 0x8F50, 0xFBEF, 0xEA66, 0xD8FD, 0xC974, /**/
-0x4204, 0x538D, 0x6116, 0x709F, 0x0420, 0x15A9, 0x2732, 0x36BB, /**/
-0xCE4C, 0xDFC5, 0xED5E, 0xFCD7, 0x8868, 0x99E1, 0xAB7A, 0xBAF3, /**/
-0x5285, 0x430C, 0x7197, 0x601E, 0x14A1, 0x0528, 0x37B3, 0x263A, /**/
-0xDECD, 0xCF44, 0xFDDF, 0xEC56, 0x98E9, 0x8960, 0xBBFB, 0xAA72, /**/
-0x6306, 0x728F, 0x4014, 0x519D, 0x2522, 0x34AB, 0x0630, 0x17B9, /**/
-0xEF4E, 0xFEC7, 0xCC5C, 0xDDD5, 0xA96A, 0xB8E3, 0x8A78, 0x9BF1, /**/
-0x7387, 0x620E, 0x5095, 0x411C, 0x35A3, 0x242A, 0x16B1, 0x0738, /**/
-0xFFCF, 0xEE46, 0xDCDD, 0xCD54, 0xB9EB, 0xA862, 0x9AF9, 0x8B70, /**/
-0x8408, 0x9581, 0xA71A, 0xB693, 0xC22C, 0xD3A5, 0xE13E, 0xF0B7, /**/
-0x0840, 0x19C9, 0x2B52, 0x3ADB, 0x4E64, 0x5FED, 0x6D76, 0x7CFF, /**/
-0x9489, 0x8500, 0xB79B, 0xA612, 0xD2AD, 0xC324, 0xF1BF, 0xE036, /**/
-0x18C1, 0x0948, 0x3BD3, 0x2A5A, 0x5EE5, 0x4F6C, 0x7DF7, 0x6C7E, /**/
-0xA50A, 0xB483, 0x8618, 0x9791, 0xE32E, 0xF2A7, 0xC03C, 0xD1B5, /**/
-0x2942, 0x38CB, 0x0A50, 0x1BD9, 0x6F66, 0x7EEF, 0x4C74, 0x5DFD, /**/
-0xB58B, 0xA402, 0x9699, 0x8710, 0xF3AF, 0xE226, 0xD0BD, 0xC134, /**/
-0x39C3, 0x284A, 0x1AD1, 0x0B58, 0x7FE7, 0x6E6E, 0x5CF5, 0x4D7C, /**/
-0xC60C, 0xD785, 0xE51E, 0xF497, 0x8028, 0x91A1, 0xA33A, 0xB2B3, /**/
-0x4A44, 0x5BCD, 0x6956, 0x78DF, 0x0C60, 0x1DE9, 0x2F72, 0x3EFB, /**/
-0xD68D, 0xC704, 0xF59F, 0xE416, 0x90A9, 0x8120, 0xB3BB, 0xA232, /**/
-0x5AC5, 0x4B4C, 0x79D7, 0x685E, 0x1CE1, 0x0D68, 0x3FF3, 0x2E7A, /**/
-0xE70E, 0xF687, 0xC41C, 0xD595, 0xA12A, 0xB0A3, 0x8238, 0x93B1, /**/
-0x6B46, 0x7ACF, 0x4854, 0x59DD, 0x2D62, 0x3CEB, 0x0E70, 0x1FF9, /**/
-0xF78F, 0xE606, 0xD49D, 0xC514, 0xB1AB, 0xA022, 0x92B9, 0x8330, /**/
-0x7BC7, 0x6A4E, 0x58D5, 0x495C, 0x3DE3, 0x2C6A, 0x1EF1, 0x0F78, /**/
-};
-
-// CCITTCRC16
-uint16_t CCITTCRC16(uint8_t *p, uint32_t len, uint16_t crc) {
-	while (len--) {
-		crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-	}
-	return crc;
-}
-
 GPI2C::GPI2C(I2CImpl *bus, uint16_t addr) {
 	this->bus = bus;
 	this->addr = addr;
 }
 
-void GPI2C::begin() { // initial IFSC 249? arduino max is 255(uint8) -1 addr = 254 - 5 frame
-	bus->setClock(1'000'000); // bus->setClock(3'400'000); // maximum
+bool GPI2C::CIP(const uint8_t *buf, uint32_t len, cip_t &cip) {
+	const uint8_t *plp, *dllp;
+	uint32_t p = 0, plpLen, dllpLen;
+
+	cip = {};
+	if (len < 2)
+		return false;
+	cip.pver = buf[p++];
+	p += 1 + buf[p]; // IIN
+	if (p + 2 > len)
+		return false;
+	cip.plid = buf[p++];
+	plpLen = buf[p++], plp = &buf[p], p += plpLen;
+	if (p + 1 > len)
+		return false;
+	dllpLen = buf[p++], dllp = &buf[p], p += dllpLen;
+	if (p + 1 > len)
+		return false;
+	cip.hbLen = buf[p++];
+	if (p + cip.hbLen > len)
+		return false;
+	if (cip.hbLen > sizeof(cip.hb))
+		cip.hbLen = sizeof(cip.hb);
+	memcpy(cip.hb, &buf[p], cip.hbLen);
+
+	if (cip.plid == 0x02 && plpLen >= 12) { // I2C: RFU, MCF, CONFIG, MPOT, RFU (3), SEGT, WUT
+		cip.mcf = (plp[1] << 8) | plp[2];
+		cip.config = plp[3];
+		cip.mpot = plp[4];
+		cip.segt = (plp[8] << 8) | plp[9];
+		cip.wut = (plp[10] << 8) | plp[11];
+	}
+	if (dllpLen >= 4) { // BWT, IFSC
+		cip.bwt = (dllp[0] << 8) | dllp[1];
+		cip.ifsc = (dllp[2] << 8) | dllp[3];
+	}
+	return cip.ifsc != 0;
+}
+
+bool GPI2C::begin() {
+	return reset() && negotiate();
+}
+
+bool GPI2C::reset() {
+	ARM(bwtMs + T1_BUDGET_MS);
+	return SWR();
+}
+
+bool GPI2C::negotiate() {
+	ARM(T1_BUDGET_MS);
+	return IFSD();
+}
+
+bool GPI2C::probe() {
+	uint8_t pcb, inf[GPI2C_BUFSZ];
+	t1frame_t frame;
+	cip_t now;
+	int32_t n;
+
+	if (stale) { // an aborted command may still execute, as in T1TX
+		ARM(bwtMs + T1_BUDGET_MS);
+		if (!RESYNCH())
+			return false;
+		stale = false;
+	}
+	ARM(T1_BUDGET_MS);
+	T1FRAME(frame, 0xC4, NULL, 0);
+	return !WRI2C(frame) && (n = T1XCHG(frame, pcb, inf, GPI2C_BUFSZ)) >= 0 && pcb == 0xE4 && CIP(inf, n, now)
+			&& !memcmp(&now, &cip, sizeof(cip));
+}
+
+bool GPI2C::release() {
+	uint8_t pcb, inf[T1_CRC_SZ];
+	t1frame_t frame;
+
+	ARM(T1_BUDGET_MS);
+	T1FRAME(frame, 0xC5, NULL, 0);
+	return !WRI2C(frame) && T1XCHG(frame, pcb, inf, sizeof(inf)) == 0 && pcb == 0xE5;
+}
+
+bool GPI2C::RESET() {
+	return SWR() && IFSD();
+}
+
+bool GPI2C::SWR() {
+	uint8_t pcb, inf[GPI2C_BUFSZ];
+	t1frame_t frame;
+	int32_t n;
+
+	bus->setClock(clockHz = 400'000); // Fm until the CIP tells the maximum
+
+	apduCtr = seSeq = 0; // reset ADPU counter on ATR/CIP
+	T1FRAME(frame, 0xCF, NULL, 0);
+	if (WRI2C(frame) || (n = T1XCHG(frame, pcb, inf, GPI2C_BUFSZ)) < 0 || pcb != 0xEF)
+		return false;
+	if (!n) { // S(SWR) without CIP, request it
+		T1FRAME(frame, 0xC4, NULL, 0);
+		if (WRI2C(frame) || (n = T1XCHG(frame, pcb, inf, GPI2C_BUFSZ)) < 0 || pcb != 0xE4)
+			return false;
+	}
+	if (!CIP(inf, n, cip))
+		return false;
+
+	ifsc = cip.ifsc;
+	pollUs = cip.mpot ? cip.mpot * 100 : POLL_MIN_US;
+	if (cip.bwt)
+		bwtMs = cip.bwt;
+	if (cip.mcf)
+		bus->setClock(clockHz = cip.mcf * 1000u < GPI2C_MAX_CLOCK ? cip.mcf * 1000u : GPI2C_MAX_CLOCK);
+	return true;
+}
+
+bool GPI2C::IFSD() { // INF and CRC of a block are read in one I2C transfer
+	uint8_t pcb, inf[T1_CRC_SZ];
+	t1frame_t frame;
 
-	//apdu[0] = 0x20;
-	//se1.I2CTX(0xC1, &apdu[0], 1, 1)
-	//I2CTX(xx, 0, 0, 0); // set IFSC, etc.
+	inf[0] = GPI2C_BUFSZ - T1_CRC_SZ;
+	T1FRAME(frame, 0xC1, inf, 1);
+	return !WRI2C(frame) && T1XCHG(frame, pcb, inf, sizeof(inf)) == 1 && pcb == 0xE1;
 }
 
 void GPI2C::close() { // currently noop
 }
 
-uint32_t GPI2C::WRI2C(uint8_t *buf, uint32_t len) {
+// a target holding SDA low is clocked out of its byte with up to 9 SCL pulses, then a STOP releases the bus
+bool GPI2C::BUSCLEAR() {
+	if (sdaPin < 0 || sclPin < 0)
+		return false;
+	bus->end();
+	pinMode(sdaPin, INPUT);
+	pinMode(sclPin, OUTPUT);
+	for (uint8_t i = 0; i < 9 && !digitalRead(sdaPin); i++) {
+		digitalWrite(sclPin, LOW);
+		delayMicroseconds(5);
+		digitalWrite(sclPin, HIGH);
+		delayMicroseconds(5);
+	}
+	pinMode(sdaPin, OUTPUT); // STOP: SDA rises while SCL is high
+	digitalWrite(sdaPin, LOW);
+	delayMicroseconds(5);
+	digitalWrite(sdaPin, HIGH);
+	delayMicroseconds(5);
+	pinMode(sdaPin, INPUT);
+	pinMode(sclPin, INPUT);
+	bus->begin();
+	bus->setClock(clockHz);
+	return true;
+}
+
+bool GPI2C::POWERCYCLE() {
+	if (pwrPin < 0)
+		return false;
+	pinMode(pwrPin, OUTPUT);
+	digitalWrite(pwrPin, LOW);
+	delay(T1_POWER_OFF_MS);
+	digitalWrite(pwrPin, HIGH);
+	delayMicroseconds(cip.wut ? cip.wut : 1000); // wake-up time
+	return true;
+}
+
+// escalate until the SE answers again, each step within T1_BUDGET_MS: S(RESYNCH), S(SWR), clock out a
+// stuck bus and S(SWR), power cycle and S(SWR). Returns the step that succeeded, 0 if none did.
+uint8_t GPI2C::RECOVER() {
+	stats.count(STAT_RECOVERIES);
+	recovering = true;
+	uint8_t step = 1;
+	for (; step <= 4; step++) {
+		if ((step == 3 && !BUSCLEAR()) || (step == 4 && !POWERCYCLE()))
+			continue;
+		ARM(T1_BUDGET_MS);
+		if (step == 1 ? RESYNCH() : RESET())
+			break;
+		trace.event(TRACE_T1_RECOVER, addr, step);
+	}
+	recovering = false;
+	return step <= 4 ? step : 0;
+}
+
+uint32_t GPI2C::BACKOFF(uint32_t wait) { // wait, return next poll interval
+	delayMicroseconds(wait);
+	YIELD();
+	return wait < POLL_MAX_US / 2 ? wait << 1 : POLL_MAX_US;
+}
+
+void GPI2C::SLEEP(uint32_t us) { // sleep in slices of POLL_MAX_US, the wait callback runs in between
+	for (uint32_t t0 = micros(), n; !EXPIRED() && (n = micros() - t0) < us;) {
+		n = us - n;
+		delayMicroseconds(n < POLL_MAX_US ? n : POLL_MAX_US);
+		YIELD();
+	}
+}
+
+uint32_t GPI2C::WRI2C(const t1frame_t &frame) { // header, INF from the caller's buffer, CRC
+	const uint32_t len = (frame.hdr[2] << 8) | frame.hdr[3];
 	uint8_t i2cErr = -1;
-	for (uint32_t i = 0, written = 0; i < maxTries && i2cErr != 0; i++) {
+	for (uint32_t wait = pollUs;; wait = BACKOFF(wait), stats.count(STAT_WR_NACKS)) {
 		bus->beginTransmission(addr);
-		written = bus->write(buf, len);
-		if ((i2cErr = bus->endTransmission(true)))
-			delay(5);
+		bus->write(frame.hdr, T1_HDR_SZ);
+		if (len)
+			bus->write(frame.inf, len);
+		bus->write(frame.crc, T1_CRC_SZ);
+		if (!(i2cErr = bus->endTransmission(true)) || EXPIRED())
+			break;
 	}
+	if (!i2cErr)
+		stats.count(STAT_BUS_TX, T1_HDR_SZ + len + T1_CRC_SZ);
 	return i2cErr;
 }
 
 uint32_t GPI2C::RDI2C(uint8_t *buf, uint32_t len) {
 	uint32_t msgSz = 0;
-	for (int i = 0; i < maxTries && msgSz == 0; i++) {
-		if (!(msgSz = bus->requestFrom((uint8_t) addr, (uint8_t) len, (uint8_t) 1)))
-			delay(5);
+	for (uint32_t wait = pollUs;; wait = BACKOFF(wait), nacks++) {
+		if ((msgSz = bus->requestFrom((uint8_t) addr, (size_t) len, (bool) 1)) || EXPIRED())
+			break;
 	}
-	return msgSz <= 0 ? msgSz : bus->readBytes(buf, msgSz);
+	return msgSz <= 0 || buf == NULL ? msgSz : bus->readBytes(buf, msgSz); // buf == NULL: caller reads from bus
 }
 
 /* GlobalPlatform APDU Transport over SPI/I2C v1.0 | GPC_SPE_172 - also called "T=1'" */
-uint32_t GPI2C::I2CTX(uint8_t pcb, uint8_t *buf, uint32_t lc, uint32_t le) {
-	if (pcb == 0xCF)
-		apduCtr = 0; // reset ADPU counter on ATR/CIP
-
-	if (lc >= 4089) // XXX: check if buf == apduBuf[3] and re-use same buffer
-		return -1; // XXX: use ATR/CIP IFSC to check for max frame size
-
-	// TODO: check PCB byte for encoding details
-	uint8_t t1frame[4 + (buf == NULL ? 0 : lc) + 2] = // if buf==NULL transmit no data, lc is info field
-			{ nad, pcb, (uint8_t) ((buf == NULL) ? lc : (lc >> 8)), (uint8_t) ((buf == NULL) ? 0 : lc) };
-	if (buf == NULL)
-		lc = 0;
-	memcpy(&t1frame[4], buf, lc);
-	uint16_t crc = ~CCITTCRC16(&t1frame[0], 4 + lc, ~0);
-	t1frame[4 + lc + 0] = crc >> 8;
-	t1frame[4 + lc + 1] = crc;
-
-	if (WRI2C(&t1frame[0], 4 + lc + 2) == 0) {
-		le = RDI2C(&t1frame[0], 4);
-		// TODO: CHECK [0] NAD = 0x12 & PCB chain/number
-		pcb = t1frame[1], le = (t1frame[2] << 8) | t1frame[3];
-
-		Serial.printf("I2TX-R: %2.2X, %2.2X %4.4X\n", t1frame[0], pcb, le);
-
-//		if (!(pcb & 0x80)) { // ... data
-//			if (buf != NULL)
-//				le = RDI2C(&buf[0], le + 2); // +CRC? (+SW1SW2?)
-//
-//			// XXX: check CRC and request re-transmit if failed
-//
-//			if (pcb & 0x40) { // ... more data, acknowledge
-//				t1frame[0] = nad;
-//				t1frame[1] = (!(pcb & (1 << 6))) << 6;
-//				t1frame[2] = t1frame[3] = 0;
-//				uint16_t crc = ~CCITTCRC16(&t1frame[0], 4 + lc, ~0);
-//				t1frame[4 + 0 + 0] = crc >> 8;
-//				t1frame[4 + 0 + 1] = crc;
-//				if (WRI2C(&t1frame[0], 4 + lc + 2) == 0) {
-//					le = RDI2C(&t1frame[0], 4);
-//					// TODO: CHECK [0] NAD = 0x12 & PCB chain/number
-//					pcb = t1frame[1], le = (t1frame[2] << 8) | t1frame[3];
-//
-//					Serial.printf("I2TX-R2: %2.2X, %2.2X %4.4X", t1frame[0], pcb, le);
-//
-//					if (!(pcb & 0x80)) { // ... data
-//						if (buf != NULL)
-//							le = RDI2C(&buf[0], le + 2); // +CRC? (+SW1SW2?)
-//					}
-//
-//				}
-//			}
-//		} else { // control code or error
-//
-//		}
-
-
-		if (buf != NULL)
-			le = RDI2C(&buf[0], le + 2); // +CRC? (+SW1SW2?)
-
-		// XXX: if WTX, reply and read again
-		// XXX: check CRC and request re-transmit if failed
-		le -= 2;
-		if (buf == NULL)
-			le = 0;
+uint32_t GPI2C::T1FRAME(t1frame_t &frame, uint8_t pcb, const uint8_t *inf, uint32_t len) { // INF is not copied
+	frame.hdr[0] = nad;
+	frame.hdr[1] = pcb;
+	frame.hdr[2] = len >> 8;
+	frame.hdr[3] = len;
+	frame.inf = inf;
+	uint16_t crc = CRC16<>().update(frame.hdr, T1_HDR_SZ).update(inf, len).final();
+	frame.crc[0] = crc >> 8;
+	frame.crc[1] = crc;
+	return T1_HDR_SZ + len + T1_CRC_SZ;
+}
+
+// receive one block, INF is read to inf which must hold LEN bytes
+int32_t GPI2C::T1RX(uint8_t &pcb, uint8_t *inf, uint32_t max) {
+	uint8_t hdr[T1_HDR_SZ];
+	nacks = 0;
+	const bool got = RDI2C(&hdr[0], T1_HDR_SZ) == T1_HDR_SZ;
+	stats.count(STAT_POLLS, nacks);
+	if (!got)
+		return -1;
+	rxAt = micros();
+
+	pcb = hdr[1];
+	uint32_t len = (hdr[2] << 8) | hdr[3];
+
+	trace.event(TRACE_T1_BLOCK, addr, 0, hdr, T1_HDR_SZ);
+
+	if (hdr[0] != (uint8_t) ((nad >> 4) | (nad << 4)) || len > max || len + T1_CRC_SZ > GPI2C_BUFSZ)
+		return -1;
+
+	if (RDI2C(NULL, len + T1_CRC_SZ) != len + T1_CRC_SZ)
+		return -1;
+	stats.count(STAT_BUS_RX, T1_HDR_SZ + len + T1_CRC_SZ);
+
+	// INF is copied off the bus and checked in one pass. R-blocks have none and a repeated I-block is
+	// only checked, neither may overwrite the APDU buffer: the command may still have to be sent again.
+	CRC16<> crc;
+	crc.update(hdr, T1_HDR_SZ);
+	if ((pcb & 0xC0) == 0xC0 || (!(pcb & 0x80) && ((pcb >> 6) & 1) == seSeq)) {
+		for (uint32_t i = 0; i < len; i++)
+			crc.update(inf[i] = bus->read());
 	} else {
-		le = 0;
-		buf[le++] = 0x6F;
-		buf[le++] = 0xFF;
+		for (uint32_t i = 0; i < len; i++)
+			crc.update(bus->read());
+	}
+	uint16_t rxCrc = bus->read() << 8;
+	rxCrc |= bus->read();
+
+	if (rxCrc != crc.final()) {
+		stats.count(STAT_CRC_ERRORS);
+		return -1;
+	}
+	return len;
+}
+
+// receive the answer to frame, which has been sent already: corrupted or missing blocks are NACKed,
+// requests to repeat a block and S(WTX) are served, at most T1_RETRIES times. I-blocks are checked for N(S).
+// The I-block is only repeated on request, once the SE got it a lost answer is asked for with R(N(R)).
+int32_t GPI2C::T1XCHG(const t1frame_t &frame, uint8_t &pcb, uint8_t *inf, uint32_t max) {
+	const t1frame_t *last = &frame;
+	t1frame_t ctl, wtxr;
+	uint8_t mult;
+
+	for (uint8_t retries = 0;;) {
+		int32_t rx = T1RX(pcb, inf, max);
+
+		if (rx == 1 && pcb == 0xC3) { // S(WTX request): acknowledge, the SE needs multiplier x BWT from now on
+			mult = inf[0];
+			stats.count(STAT_WTX);
+			T1FRAME(wtxr, 0xE3, &mult, 1);
+			ARM((mult ? mult : 1) * bwtMs + T1_BUDGET_MS);
+			if (WRI2C(*(last = &wtxr)))
+				return -1;
+			continue;
+		}
+		if (rx >= 0 && !(pcb & 0x80) && ((pcb >> 6) & 1) == seSeq) { // I-block in sequence
+			seSeq ^= 1;
+			return rx;
+		}
+		if (rx >= 0 && ((pcb & 0xC0) == 0xC0 // S-block response, R-block acknowledging the last I-block
+				|| ((pcb & 0xC0) == 0x80 && !(pcb & 0x03) && ((pcb >> 4) & 1) == (apduCtr & 1))))
+			return rx;
+
+		if (++retries > T1_RETRIES || EXPIRED())
+			return -1;
+		stats.count(STAT_RETRANSMITS);
+		if (rx < 0) { // R(N(R)) with EDC error, the SE repeats its last block
+			T1FRAME(ctl, 0x81 | (seSeq << 4), NULL, 0);
+			last = &ctl;
+		} else if ((pcb & 0xC0) == 0x80 && ((pcb >> 4) & 1) != (apduCtr & 1)) { // SE asks for our last I-block
+			last = &frame;
+			ARM(bwtMs + T1_BUDGET_MS); // it executes the command from the repetition on
+		} // otherwise our last block was damaged or an I-block arrived out of sequence: repeat it
+		if (CRC16<>().update(last->hdr, T1_HDR_SZ).update(last->inf, (last->hdr[2] << 8) | last->hdr[3]).final()
+				!= ((last->crc[0] << 8) | last->crc[1]) || WRI2C(*last))
+			return -1; // INF in the APDU buffer may have been overwritten by a damaged block
 	}
+}
+
+bool GPI2C::RESYNCH() { // S(RESYNCH): both sides restart with N(S) = 0
+	uint8_t pcb, inf[T1_CRC_SZ];
+	t1frame_t frame;
 
-	return le;
+	T1FRAME(frame, 0xC0, NULL, 0);
+	for (uint8_t retries = 0; retries <= T1_RETRIES && !EXPIRED(); retries++) {
+		if (!WRI2C(frame) && T1RX(pcb, inf, sizeof(inf)) == 0 && pcb == 0xE0) {
+			apduCtr = seSeq = 0;
+			return true;
+		}
+	}
+	return false;
 }
 
-uint32_t GPI2C::T1TX(uint8_t *buf, uint32_t li, uint32_t lo) {
-	uint8_t chain = 0;
-	uint32_t read = I2CTX((((apduCtr++) & 1) << 6) | (chain << 5), buf, li, lo);
-	return read;
+// one command / response exchange, sent is set once the last I-block went out and the SE may have executed it
+int32_t GPI2C::T1APDU(uint8_t *buf, uint32_t li, uint32_t lo, bool &sent) {
+	const uint32_t ifs = ifsc < GPI2C_BUFSZ - T1_HDR_SZ - T1_CRC_SZ ? ifsc : GPI2C_BUFSZ - T1_HDR_SZ - T1_CRC_SZ;
+	uint8_t cur = 0, pcb, rb[T1_CRC_SZ];
+	uint32_t off = 0, n = li < ifs ? li : ifs;
+	int32_t rx;
+	t1frame_t frame[2]; // the block being acknowledged and the next one
+
+	T1FRAME(frame[cur], ((apduCtr & 1) << 6) | ((n < li) << 5), buf, n);
+
+	const uint8_t ins = li > 1 ? buf[1] : 0;
+	uint32_t t0, rx0 = micros(); // last command block written, first response header read
+
+	for (;;) { // send command, chained in I-blocks of at most IFSC bytes
+		if (WRI2C(frame[cur]))
+			return -1;
+		t0 = micros();
+		yielded = 0;
+		apduCtr++;
+		off += n;
+		if (off >= li)
+			break;
+
+		// prepare the next block (CRC over the chunk in place) while the SE processes the current one
+		n = li - off < ifs ? li - off : ifs;
+		T1FRAME(frame[cur ^ 1], ((apduCtr & 1) << 6) | ((off + n < li) << 5), &buf[off], n);
+
+		// SE acknowledges with R(N(R)), N(R) being the N(S) of the block expected next
+		if (T1XCHG(frame[cur], pcb, rb, sizeof(rb)) != 0 || (pcb & 0xC0) != 0x80)
+			return -1;
+		cur ^= 1;
+	}
+	sent = true;
+	stats.stage(STAGE_I2C_WR, t0 - rx0);
+	dueAt = t0 + insTime[ins] * POLL_TQ_US * 9 / 8;
+	executing = true;
+
+	// sleep through most of the expected execution time, then poll from MPOT on
+	SLEEP(insTime[ins] * POLL_TQ_US * 15 / 16);
+
+	for (off = 0;;) { // receive response, acknowledge chained I-blocks
+		if ((rx = T1XCHG(frame[cur], pcb, &buf[off], lo - off)) < 0 || (pcb & 0x80))
+			return -1;
+		executing = false;
+		if (!off && yielded < POLL_MAX_US) { // learn execution time: average over 4 commands if polled, otherwise probe shorter
+			uint32_t t = (rxAt - t0) / POLL_TQ_US; // not if other slots ran in between, the SE may have waited for us
+			t = nacks ? (insTime[ins] * 3 + (t < 0xFFFF ? t : 0xFFFF) + 3) / 4 : insTime[ins] - insTime[ins] / 16;
+			insTime[ins] = t;
+		}
+		if (!off) {
+			rx0 = rxAt;
+			stats.stage(STAGE_SE, rx0 - t0);
+		}
+		off += rx;
+		if (!(pcb & 0x20))
+			break;
+
+		cur ^= 1;
+		T1FRAME(frame[cur], 0x80 | (seSeq << 4), NULL, 0);
+		if (WRI2C(frame[cur]))
+			return -1;
+	}
+	stats.stage(STAGE_I2C_RD, micros() - rx0);
+	return off;
+}
+
+// the APDU must complete within BWT plus T1_BUDGET_MS, S(WTX) extends this. On failure the SE is recovered:
+// after S(RESYNCH) a command that never reached the SE is repeated once, after a reset its state is lost.
+int32_t GPI2C::T1TX(uint8_t *buf, uint32_t li, uint32_t lo) {
+	bool sent = false;
+	cancelled = false;
+	if (stale) { // the aborted command may still execute: S(RESYNCH) once the SE listens again
+		ARM(bwtMs + T1_BUDGET_MS);
+		if (!RESYNCH() && !RECOVER())
+			return T1_ERR_HW;
+		stale = false;
+		if (cancelled) { // aborted while resynchronising, the command was not sent
+			cancelled = false;
+			return T1_ERR_ABORTED;
+		}
+	}
+
+	for (uint8_t attempt = 0;; attempt++) {
+		ARM(bwtMs + T1_BUDGET_MS);
+		int32_t n = T1APDU(buf, li, lo, sent);
+		executing = false;
+		if (n >= 0)
+			return n;
+		if (cancelled) { // leave the SE alone until the next command
+			cancelled = false;
+			stale = true;
+			return T1_ERR_ABORTED;
+		}
+
+		const bool mute = EXPIRED();
+		trace.event(TRACE_T1_FAIL, addr, mute | sent << 1);
+		const uint8_t step = RECOVER();
+		if (!step)
+			return T1_ERR_HW;
+		if (cancelled) { // aborted while recovering, reported once the SE is in sync
+			cancelled = false;
+			return T1_ERR_ABORTED;
+		}
+		if (step > 1 || sent || attempt)
+			return mute ? T1_ERR_MUTE : T1_ERR_XFR;
+	}
 }
 
 } // end namespace
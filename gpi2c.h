@@ -29,28 +29,157 @@
 
 #define I2CImpl TwoWire
 
+#ifndef GPI2C_BUFSZ
+#define GPI2C_BUFSZ (256) // I2C driver buffer, limits a frame to 4 + INF + 2 bytes
+#endif
+
+#define T1_HDR_SZ (4) // NAD, PCB, LEN (2)
+#define T1_CRC_SZ (2)
+
+#ifndef GPI2C_MAX_CLOCK
+#define GPI2C_MAX_CLOCK (1'000'000) // I2C host limit, RP2040: Fm+
+#endif
+
+#define POLL_MIN_US (25) // used if the CIP does not specify MPOT
+#define POLL_MAX_US (1000) // back-off limit, bounds polling overhead for long running commands
+#define POLL_TQ_US (32) // time quantum of learned execution times
+
+#define T1_RETRIES (3) // retransmissions of a damaged or missing block before S(RESYNCH)
+
+#ifndef T1_BUDGET_MS
+#define T1_BUDGET_MS (100) // APDU deadline: BWT (or the S(WTX) extension) plus budget, also bounds each recovery step
+#endif
+#define T1_POWER_OFF_MS (10) // SE supply off time of a power cycle
+
+// T1TX failures, reported by the CCID layer as slot errors
+#define T1_ERR_MUTE (-1) // deadline expired, the SE recovered
+#define T1_ERR_XFR (-2) // transmission errors, the SE recovered
+#define T1_ERR_HW (-3) // the SE did not recover
+#define T1_ERR_ABORTED (-4) // cancelled, the SE is resynchronised before the next command
+
 //namespace kisses { // keep it small & simple embedded security
 namespace seccid { // secure element CCID
 
+// Communication Interface Parameters (GPC_SPE_172), returned on S(SWR) / S(CIP)
+typedef struct {
+	uint8_t pver, plid; // protocol version, physical layer (0x02: I2C)
+	uint16_t mcf; // maximum clock frequency, kHz
+	uint8_t config, mpot; // I2C configuration, minimum polling time in 100 us
+	uint16_t segt, wut; // SE guard time, power wake-up time, us
+	uint16_t bwt, ifsc; // block waiting time in ms, maximum information field size of the SE
+	uint8_t hbLen, hb[15]; // historical bytes
+} cip_t;
+
+// T=1' block as written to the bus: header and CRC around an INF field that stays in the caller's buffer
+typedef struct {
+	uint8_t hdr[T1_HDR_SZ];
+	const uint8_t *inf;
+	uint8_t crc[T1_CRC_SZ];
+} t1frame_t;
+
 class GPI2C {
 	I2CImpl *bus;
-	uint8_t addr = 0x48, nad = 0x21, i2cmode = 0, maxTries = 255, atr[40], apduBuf[1000 + 16 + 8 + 10 + 5]; // payload + max padding + CMAC + T1 header (4 + 4 + 2) + response frame (superfluous)
-	uint16_t ifsc = 254, apduCtr = 0;
+	uint8_t addr = 0x48, nad = 0x21, i2cmode = 0;
+	cip_t cip = { };
+	uint16_t ifsc = 254, apduCtr = 0; // apduCtr: N(S) of the next I-block
+	uint8_t seSeq = 0; // N(S) expected from the SE
+	int8_t sdaPin = -1, sclPin = -1, pwrPin = -1; // bus recovery and SE supply, -1: not available
+	uint32_t clockHz = 400'000, deadline = 0; // bus clock from the CIP, micros() the current exchange must end
+	bool cancelled = false, stale = false; // abort requested, an aborted command may still be executing
+	bool recovering = false; // an abort waits until RECOVER() has the SE in sync again
 
-	// I2C read / write
-	uint32_t WRI2C(uint8_t *buf, uint32_t len);
+	// polling: minimum poll interval (CIP MPOT), block waiting time (CIP BWT), execution time per INS in POLL_TQ_US
+	uint16_t pollUs = 100, bwtMs = 1000, insTime[256] = { };
+	uint32_t rxAt = 0, nacks = 0; // micros() when the SE acknowledged the last block header, NACKs before
+	uint32_t yielded = 0; // us spent in the wait callback since the last command block
+	uint32_t dueAt = 0; // micros() the response of the command the SE executes is due, while executing
+	bool executing = false;
+	void (*waitCb)(void) = NULL; // called while waiting for the SE, e.g. to keep the host informed
+
+	// I2C read / write, retried with exponential back-off while the SE NACKs, until the deadline
+	void ARM(uint32_t ms) {
+		deadline = micros() + ms * 1000u;
+	}
+	bool EXPIRED() { // also ends the exchange at the next frame boundary once cancelled, except while recovering
+		return (cancelled && !recovering) || (int32_t) (micros() - deadline) > 0;
+	}
+	void YIELD() { // run the wait callback, time spent there does not count against the deadline
+		if (waitCb) {
+			uint32_t t = micros();
+			waitCb();
+			t = micros() - t;
+			deadline += t;
+			yielded += t;
+		}
+	}
+	uint32_t WRI2C(const t1frame_t &frame);
 	uint32_t RDI2C(uint8_t *buf, uint32_t len);
+	uint32_t BACKOFF(uint32_t wait);
+	void SLEEP(uint32_t us);
+
+	// T=1' frame build / block receive
+	uint32_t T1FRAME(t1frame_t &frame, uint8_t pcb, const uint8_t *inf, uint32_t len);
+	int32_t T1RX(uint8_t &pcb, uint8_t *inf, uint32_t max);
+
+	// T=1' error recovery: answer to a sent block with retransmission and WTX, resynchronisation
+	int32_t T1XCHG(const t1frame_t &frame, uint8_t &pcb, uint8_t *inf, uint32_t max);
+	bool RESYNCH();
+	int32_t T1APDU(uint8_t *buf, uint32_t li, uint32_t lo, bool &sent);
+
+	// SE recovery: soft reset (S(SWR), CIP, IFSD), release a stuck bus, power cycle, and the ladder through them
+	bool SWR();
+	bool IFSD();
+	bool RESET();
+	bool BUSCLEAR();
+	bool POWERCYCLE();
+	uint8_t RECOVER();
 public:
-	GPI2C(I2CImpl *bus, uint16_t addr = 0x48);
+	GPI2C(I2CImpl *bus = NULL, uint16_t addr = 0x48);
 
-	void begin();
+	// soft reset, apply CIP (clock, IFSC, timing) and negotiate IFSD
+	bool begin();
+	// the steps of begin(): soft reset and CIP, then S(IFS)
+	bool reset();
+	bool negotiate();
+	// warm re-attach, one S(CIP) exchange: true while the SE reports the CIP known, N(S) and learned timing are kept
+	bool probe();
+	// S(RELEASE): the SE may save power until the next block
+	bool release();
 	void close();
 
-	// I2C tranaction
-	uint32_t I2CTX(uint8_t pcb, uint8_t *buf, uint32_t lc, uint32_t le);
+	const cip_t& getCIP() const {
+		return cip;
+	}
+	uint32_t getClock() const {
+		return clockHz;
+	}
+	static bool CIP(const uint8_t *buf, uint32_t len, cip_t &cip);
+
+	void setWaitCallback(void (*cb)(void)) {
+		waitCb = cb;
+	}
+
+	// pins used by the recovery ladder: SDA/SCL of the bus, output switching the SE supply (high: on)
+	void setRecoveryPins(int8_t sda, int8_t scl, int8_t pwr = -1) {
+		sdaPin = sda, sclPin = scl, pwrPin = pwr;
+	}
 
-	// T1 transaction
-	uint32_t T1TX(uint8_t *buf, uint32_t lc, uint32_t le);
+	// T1 transaction, command of li bytes in buf is replaced by the response (at most lo bytes), T1_ERR_* on failure
+	int32_t T1TX(uint8_t *buf, uint32_t li, uint32_t lo);
+	// learned execution time of an INS in us, 0 until the SE executed it
+	uint32_t expectedUs(uint8_t ins) const {
+		return insTime[ins] * POLL_TQ_US;
+	}
+	// us until the response of the command the SE executes is due, 1/8 of its learned time past included. 0 when
+	// none is executing (sending, receiving, recovering) or it is late
+	uint32_t remainingUs() const {
+		const int32_t t = dueAt - micros();
+		return executing && t > 0 ? t : 0;
+	}
+	// abort the running T1TX, from its wait callback
+	void cancel() {
+		cancelled = true;
+	}
 };
 
 } // end namespace
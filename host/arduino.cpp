@@ -0,0 +1,279 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host implementation of the Arduino core subset: virtual clock, Serial, Wire
+ */
+
+#include <stdarg.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "hardware/structs/usb.h"
+#include "sim.h"
+
+namespace sim {
+
+Model model;
+
+// one clock per core, only the core that is behind in virtual time runs
+static thread_local int core = 0;
+static uint64_t coreNs[2];
+static bool dual = false;
+static int running = 0;
+static std::mutex &mtx = *new std::mutex; // never destroyed, core 1 is still waiting at exit
+static std::condition_variable &cv = *new std::condition_variable;
+
+uint64_t now() {
+	return coreNs[core];
+}
+
+void advance(uint64_t ns) {
+	coreNs[core] += ns;
+	if (dual && coreNs[core] > coreNs[core ^ 1]) { // hand over to the other core
+		std::unique_lock<std::mutex> lock(mtx);
+		running = core ^ 1;
+		cv.notify_all();
+		cv.wait(lock, [] {
+			return running == core;
+		});
+	}
+}
+
+void startCore1(void (*setup1)(), void (*loop1)()) {
+	std::unique_lock<std::mutex> lock(mtx);
+	coreNs[1] = coreNs[0];
+	dual = true;
+	std::thread([setup1, loop1] {
+		core = 1;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [] {
+				return running == 1;
+			});
+		}
+		setup1();
+		for (;;) {
+			loop1();
+			advance(model.core1IdleNs);
+		}
+	}).detach();
+}
+
+void attach(TwoWire &bus, uint8_t addr, I2CTarget *target) {
+	bus.attach(addr, target);
+}
+
+} // end namespace
+
+//--------------------------------------------------------------------+
+// time & pins
+//--------------------------------------------------------------------+
+unsigned long millis() {
+	sim::advance(sim::model.clockReadNs);
+	return sim::now() / 1'000'000;
+}
+
+unsigned long micros() {
+	sim::advance(sim::model.clockReadNs);
+	return sim::now() / 1'000;
+}
+
+void delay(unsigned long ms) {
+	sim::advance((uint64_t) ms * 1'000'000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	sim::advance((uint64_t) us * 1'000);
+}
+
+void yield() {
+	sim::usbTask();
+}
+
+static sim::PinTarget *pinTargets[32];
+
+void sim::attachPin(uint8_t pin, PinTarget *target) {
+	pinTargets[pin & 31] = target;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	(void) pin, (void) mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+	if (pinTargets[pin & 31])
+		pinTargets[pin & 31]->pinWrite(pin, val);
+}
+
+int digitalRead(uint8_t pin) { // attached pins are pulled up unless the device drives them
+	int val = pinTargets[pin & 31] ? pinTargets[pin & 31]->pinRead(pin) : LOW;
+	return val < 0 ? HIGH : val;
+}
+
+uint8_t rp2040_chip_version() {
+	return 2;
+}
+
+uint8_t rp2040_rom_version() {
+	return 3;
+}
+
+void pico_get_unique_board_id_string(char *id_out, unsigned len) {
+	snprintf(id_out, len, "%s", "E6614103E7452D2F");
+}
+
+static usb_hw_t usb_regs = { USB_SIE_STATUS_VBUS_DETECTED_BITS };
+usb_hw_t *const usb_hw = &usb_regs;
+
+//--------------------------------------------------------------------+
+// Print / Stream / Serial
+//--------------------------------------------------------------------+
+size_t Print::write(const uint8_t *buf, size_t len) {
+	size_t n = 0;
+	while (len--)
+		n += write(*buf++);
+	return n;
+}
+
+size_t Print::print(const char *str) {
+	return write((const uint8_t*) str, strlen(str));
+}
+
+size_t Print::println(const char *str) {
+	size_t n = print(str);
+	return n + write((const uint8_t*) "\r\n", 2);
+}
+
+size_t Print::printf(const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return 0;
+	return write((const uint8_t*) buf, (size_t) n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+size_t Stream::readBytes(uint8_t *buf, size_t len) {
+	size_t n = 0;
+	for (int c; n < len && (c = read()) >= 0; buf[n++] = c)
+		;
+	return n;
+}
+
+String Stream::readString() {
+	String s;
+	for (int c; (c = read()) >= 0; s += (char) c)
+		;
+	return s;
+}
+
+SerialUSB Serial;
+
+size_t SerialUSB::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t SerialUSB::write(const uint8_t *buf, size_t len) {
+	sim::advance(sim::model.printCallNs + len * sim::model.printCharNs);
+	if (sim::model.verbose)
+		fwrite(buf, 1, len, stderr);
+	return len;
+}
+
+//--------------------------------------------------------------------+
+// TwoWire
+//--------------------------------------------------------------------+
+TwoWire Wire, Wire1;
+
+void TwoWire::begin() {
+}
+
+void TwoWire::end() {
+}
+
+void TwoWire::setClock(uint32_t hz) {
+	clock = hz > 1'000'000 ? 1'000'000 : hz; // RP2040 I2C block maximum (Fm+)
+}
+
+void TwoWire::transfer(size_t bytes, uint32_t maxClock) { // start, address, data, ack bits, stop
+	uint32_t hz = clock < maxClock ? clock : maxClock;
+	sim::advance(sim::model.i2cCallNs + (2 + 9 + 9 * (uint64_t) bytes) * 1'000'000'000 / hz);
+}
+
+void TwoWire::beginTransmission(uint8_t addr) {
+	txAddr = addr & 0x7F;
+	buffLen = 0;
+	txBegun = true;
+}
+
+size_t TwoWire::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t TwoWire::write(const uint8_t *buf, size_t len) {
+	if (!txBegun)
+		return 0;
+	size_t n = 0;
+	for (; n < len && buffLen < sizeof(buff); buff[buffLen++] = buf[n++])
+		;
+	return n;
+}
+
+uint8_t TwoWire::endTransmission(bool stopBit) {
+	(void) stopBit;
+	txBegun = false;
+	sim::I2CTarget *t = targets[txAddr];
+	if (!t || !t->i2cWrite(buff, buffLen)) {
+		transfer(0, t ? t->i2cMaxClock() : clock);
+		return 2; // address NACK
+	}
+	transfer(buffLen, t->i2cMaxClock());
+	return 0;
+}
+
+size_t TwoWire::requestFrom(uint8_t addr, size_t quantity, bool stopBit) {
+	(void) stopBit;
+	buffLen = buffOff = 0;
+	if (quantity > sizeof(buff))
+		quantity = sizeof(buff);
+	sim::I2CTarget *t = targets[addr & 0x7F];
+	if (!t || !quantity || !t->i2cRead(buff, quantity)) {
+		transfer(0, t ? t->i2cMaxClock() : clock);
+		return 0;
+	}
+	transfer(quantity, t->i2cMaxClock());
+	return buffLen = quantity;
+}
+
+int TwoWire::available() {
+	return buffLen - buffOff;
+}
+
+int TwoWire::read() {
+	return buffOff < buffLen ? buff[buffOff++] : -1;
+}
+
+int TwoWire::peek() {
+	return buffOff < buffLen ? buff[buffOff] : -1;
+}
@@ -0,0 +1,679 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * end-to-end APDU latency benchmark
+ *
+ * Runs the unmodified firmware (setup()/loop(), CCID driver, process(), GPI2C) against
+ * the simulated USB host and secure element, sends CCID XfrBlock messages and reports
+ * per-APDU latency percentiles and throughput in virtual time.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "Wire.h"
+#include "ccid.h"
+#include "sesim.h"
+#include "sim.h"
+#include "stats.h"
+
+extern "C" void setup();
+extern "C" void loop();
+void setup1();
+void loop1();
+
+static sim::SecureElement se[CFG_TUD_CCID_SLOTS]; // slot 0 on Wire, slot 1 on Wire1
+static uint32_t slots = 1; // APDU i goes to slot i % slots
+static uint32_t pool = 0; // SEs pooled behind slot 0, all APDUs go there
+static uint8_t ccidSeq;
+static uint32_t timeExt; // CCID time extensions received
+static uint32_t slotChanges, hwErrors; // NotifySlotChange / HardwareError on the interrupt endpoint
+static uint8_t iccState; // bmSlotICCState of the last NotifySlotChange
+
+typedef std::vector<uint8_t> bytes;
+
+struct Reply {
+	uint8_t type, slot, seq, status, error;
+	bytes data;
+};
+
+static void send(uint8_t type, const bytes &data, uint8_t slot = 0) {
+	bytes msg(CCID_HDR_SZ + data.size());
+	msg[0] = type;
+	msg[1] = data.size(), msg[2] = data.size() >> 8, msg[3] = data.size() >> 16, msg[4] = data.size() >> 24;
+	msg[5] = slot, msg[6] = ccidSeq++;
+	std::copy(data.begin(), data.end(), msg.begin() + CCID_HDR_SZ);
+	sim::usbHostSend(msg.data(), msg.size());
+}
+
+static bool receive(Reply &r, uint64_t timeoutNs = 30'000'000'000ull) { // next response other than a time extension
+	static bytes in;
+
+	for (uint64_t t0 = sim::now(); sim::now() - t0 < timeoutNs;) {
+		uint32_t len = in.size() < CCID_HDR_SZ ? 0 : in[1] | (in[2] << 8) | (in[3] << 16) | (in[4] << 24);
+		if (len > CCID_IFSD) {
+			fprintf(stderr, "malformed CCID response, length %u\n", len);
+			return false;
+		}
+		if (in.size() < CCID_HDR_SZ + len) {
+			sim::usbTask();
+			loop();
+
+			uint8_t ntf[CCID_NOTIFY_SZ];
+			for (uint32_t n; (n = sim::usbHostNotification(ntf, sizeof(ntf)));) {
+				if (ntf[0] == NOTIFY_SLOT_CHANGE && n >= 2) {
+					slotChanges++;
+					iccState = ntf[1];
+				} else if (ntf[0] == HARDWARE_ERROR && n == 4) {
+					hwErrors++;
+				}
+				if (sim::model.verbose)
+					fprintf(stderr, "notification %2.2X %2.2X\n", ntf[0], ntf[1]);
+			}
+
+			uint8_t tmp[CCID_MSGLEN];
+			uint32_t n = sim::usbHostReceive(tmp, sizeof(tmp));
+			in.insert(in.end(), tmp, tmp + n);
+			continue;
+		}
+
+		r.type = in[0], r.slot = in[5], r.seq = in[6], r.status = in[7], r.error = in[8];
+		r.data.assign(in.begin() + CCID_HDR_SZ, in.begin() + CCID_HDR_SZ + len);
+		in.erase(in.begin(), in.begin() + CCID_HDR_SZ + len);
+		if ((r.status >> 6) == 2) { // time extension requested, keep waiting
+			timeExt++;
+			continue;
+		}
+		return true;
+	}
+	return false;
+}
+
+static void idle(uint64_t ns) { // host think time, the device keeps running
+	for (uint64_t t0 = sim::now(); sim::now() - t0 < ns;) {
+		sim::usbTask();
+		loop();
+	}
+}
+
+static bool exchange(uint8_t type, const bytes &data, Reply &r, uint8_t slot = 0) {
+	send(type, data, slot);
+	return receive(r);
+}
+
+static uint16_t sw(const bytes &rsp) {
+	return rsp.size() < 2 ? 0 : (rsp[rsp.size() - 2] << 8) | rsp[rsp.size() - 1];
+}
+
+struct Workload {
+	const char *name, *desc;
+	std::function<bytes(uint32_t)> apdu;
+	std::function<bool(uint32_t, const bytes&)> check;
+	std::function<bool()> begin = nullptr; // session opened before the APDUs, all on slot 0
+	std::function<bool(uint32_t)> end = nullptr; // closed after count APDUs
+};
+
+static const bytes AID = { 0xA0, 0x00, 0x00, 0x03, 0x96, 0x54, 0x53, 0x00, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00,
+		0x00 };
+
+static const uint8_t* fileOf(uint32_t i) { // file of the SE APDU i went to, the home member for a pool
+	return se[pool ? 0 : i % slots].file;
+}
+
+static bool checkFile(uint32_t i, uint32_t off, size_t n, const bytes &rsp) {
+	return rsp.size() == n + 2 && sw(rsp) == 0x9000 && std::equal(rsp.begin(), rsp.end() - 2, &fileOf(i)[off]);
+}
+
+// script stream of FFFF C7xx: UPDATE BINARY of 64 bytes expecting 9000, 77 bytes per entry
+static const uint32_t SCRIPT_ENTRY = 77, SCRIPT_CHUNK = 240;
+
+static uint8_t scriptByte(uint32_t pos) {
+	const uint32_t k = pos / SCRIPT_ENTRY, j = pos % SCRIPT_ENTRY;
+	const uint16_t off = (k * 64) % 4032;
+	const uint8_t head[] = { 0x80, 69, 0x00, 0xD6, (uint8_t) (off >> 8), (uint8_t) off, 64 }, tail[] = { 0x81, 4,
+			0x90, 0x00, 0xFF, 0xFF };
+	return j < 7 ? head[j] : j < 71 ? k * 7 + j - 7 : tail[j - 71];
+}
+
+static bytes scriptCmd(uint8_t op, uint32_t pos, uint32_t n) {
+	bytes a = { 0xFF, 0xFF, 0xC7, op };
+	if (n)
+		a.push_back(n);
+	for (uint32_t k = 0; k < n; k++)
+		a.push_back(scriptByte(pos + k));
+	return a;
+}
+
+static std::vector<Workload> workloads() {
+	std::vector<Workload> w;
+	w.push_back( { "select", "SELECT by 16 byte AID", [](uint32_t) {
+		bytes a = { 0x00, 0xA4, 0x04, 0x00, (uint8_t) AID.size() };
+		for (uint8_t b : AID)
+			a.push_back(b);
+		a.push_back(0x00);
+		return a;
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == AID.size() + 8;
+	} });
+	w.push_back( { "getdata", "GET DATA, 18 byte chip identity", [](uint32_t) {
+		return bytes { 0x80, 0xCA, 0x00, 0xFE, 0x00 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && std::equal(r.begin(), r.end() - 2, sim::SecureElement::chipId);
+	} });
+	w.push_back( { "getdata6c", "GET DATA, Le 8: 6C12, repeated with Le 18", [](uint32_t) {
+		return bytes { 0x80, 0xCA, 0x00, 0xFE, 0x08 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && std::equal(r.begin(), r.end() - 2, sim::SecureElement::chipId);
+	} });
+	w.push_back( { "object61", "GET DATA, 900 byte object in 61xx / GET RESPONSE parts", [](uint32_t) {
+		return bytes { 0x80, 0xCA, 0x01, 0x01, 0x00 };
+	}, [](uint32_t i, const bytes &r) {
+		return checkFile(i, 0, 900, r);
+	} });
+	w.push_back( { "random", "GET CHALLENGE, 32 bytes", [](uint32_t) {
+		return bytes { 0x00, 0x84, 0x00, 0x00, 0x20 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == 34;
+	} });
+	w.push_back( { "nonce", "FFFF C900: 32 random bytes from the prefetch pool", [](uint32_t) {
+		return bytes { 0xFF, 0xFF, 0xC9, 0x00, 0x20 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == 34;
+	} });
+	w.push_back( { "auth", "GET CHALLENGE, 8 bytes, then EXTERNAL AUTHENTICATE with it while prefetching", [](uint32_t) {
+		return bytes { 0x00, 0x84, 0x00, 0x00, 0x08 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == 10;
+	}, nullptr, [](uint32_t) { // no prefetch GET CHALLENGE between the host's pair, it would replace the challenge
+		Reply r;
+		if (pool && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xCB, 0x01 }, r) || sw(r.data) != 0x9000))
+			return false;
+		if (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC9, 0x00, 5, 0x00, 0x84, 0x00, 0x00, 0x20 }, r) || sw(r.data) != 0x9000
+				|| !exchange(XFR_BLOCK, { 0x00, 0x84, 0x00, 0x00, 0x08 }, r) || r.data.size() != 10)
+			return false;
+		const uint32_t frames = se[0].stats.framesTx;
+		idle(5'000'000);
+		bytes a = { 0x00, 0x82, 0x00, 0x00, 0x08 };
+		a.insert(a.end(), r.data.begin(), r.data.end() - 2);
+		if (se[0].stats.framesTx != frames || !exchange(XFR_BLOCK, a, r) || sw(r.data) != 0x9000)
+			return false;
+		const uint32_t after = se[0].stats.framesTx;
+		idle(5'000'000);
+		return se[0].stats.framesTx != after && (!pool
+				|| (exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xCB, 0x01, 2, 0x84, 0x2A }, r) && sw(r.data) == 0x9000));
+	} });
+	w.push_back( { "read120", "READ BINARY, 120 bytes", [](uint32_t i) {
+		uint16_t off = (i * 120) % 3840;
+		return bytes { 0x00, 0xB0, (uint8_t) (off >> 8), (uint8_t) off, 120 };
+	}, [](uint32_t i, const bytes &r) {
+		return checkFile(i, (i * 120) % 3840, 120, r);
+	} });
+	w.push_back( { "cert900", "READ BINARY, 900 bytes, extended Le", [](uint32_t) {
+		return bytes { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x03, 0x84 };
+	}, [](uint32_t i, const bytes &r) {
+		return checkFile(i, 0, 900, r);
+	} });
+	w.push_back( { "write255", "UPDATE BINARY, 255 bytes, CCID message larger than the RX FIFO", [](uint32_t i) {
+		uint16_t off = (i * 255) % 3825;
+		bytes a = { 0x00, 0xD6, (uint8_t) (off >> 8), (uint8_t) off, 0xFF };
+		for (int k = 0; k < 255; k++)
+			a.push_back(i * 3 + k);
+		return a;
+	}, [](uint32_t i, const bytes &r) {
+		const uint16_t off = (i * 255) % 3825;
+		for (int k = 0; k < 255; k++)
+			if (fileOf(i)[off + k] != (uint8_t) (i * 3 + k))
+				return false;
+		return r.size() == 2 && sw(r) == 0x9000;
+	} });
+	w.push_back( { "write1k", "UPDATE BINARY, 1000 bytes, extended Lc", [](uint32_t i) {
+		uint16_t off = (i * 1000) % 3000;
+		bytes a = { 0x00, 0xD6, (uint8_t) (off >> 8), (uint8_t) off, 0x00, 0x03, 0xE8 };
+		for (int k = 0; k < 1000; k++)
+			a.push_back(i + k * 5);
+		return a;
+	}, [](uint32_t i, const bytes &r) {
+		const uint16_t off = (i * 1000) % 3000;
+		for (int k = 0; k < 1000; k++)
+			if (fileOf(i)[off + k] != (uint8_t) (i + k * 5))
+				return false;
+		return r.size() == 2 && sw(r) == 0x9000;
+	} });
+	w.push_back( { "read250", "READ BINARY, 250 bytes", [](uint32_t i) {
+		uint16_t off = (i * 250) % 3750;
+		return bytes { 0x00, 0xB0, (uint8_t) (off >> 8), (uint8_t) off, 250 };
+	}, [](uint32_t i, const bytes &r) {
+		return checkFile(i, (i * 250) % 3750, 250, r);
+	} });
+	w.push_back( { "batch8", "FFFF C601: 8 x READ BINARY 120 bytes in one XfrBlock", [](uint32_t i) {
+		bytes a = { 0xFF, 0xFF, 0xC6, 0x01, 8 * 13 };
+		for (uint32_t k = 0; k < 8; k++) {
+			uint16_t off = ((i * 8 + k) * 120) % 3840;
+			a.insert(a.end(), { 0x80, 5, 0x00, 0xB0, (uint8_t) (off >> 8), (uint8_t) off, 120 });
+			a.insert(a.end(), { 0x81, 4, 0x90, 0x00, 0xFF, 0xFF });
+		}
+		return a;
+	}, [](uint32_t i, const bytes &r) {
+		if (r.size() != 8 * 126 + 2 || sw(r) != 0x9000)
+			return false;
+		for (uint32_t k = 0; k < 8; k++) {
+			const bytes part(r.begin() + k * 126 + 4, r.begin() + k * 126 + 126);
+			if (r[k * 126] != 0x80 || r[k * 126 + 1] != 0x82 || r[k * 126 + 3] != 122
+					|| !checkFile(i, ((i * 8 + k) * 120) % 3840, 120, part))
+				return false;
+		}
+		return true;
+	} });
+	w.push_back( { "script", "FFFF C7xx: script streamed in 240 byte chunks, 64 byte UPDATE BINARY each", [](uint32_t i) {
+		return scriptCmd(0x01, i * SCRIPT_CHUNK, SCRIPT_CHUNK);
+	}, [](uint32_t, const bytes &r) {
+		return r.size() == 6 && sw(r) == 0x9000;
+	}, [] {
+		Reply r;
+		return exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC7, 0x00, 0x01, 0x01 }, r) && sw(r.data) == 0x9000;
+	}, [](uint32_t count) { // last entry completed by the close, all executed without failure
+		const uint32_t pos = count * SCRIPT_CHUNK, rest = (SCRIPT_ENTRY - pos % SCRIPT_ENTRY) % SCRIPT_ENTRY;
+		const uint32_t entries = (pos + rest) / SCRIPT_ENTRY;
+		Reply r;
+		if (!exchange(XFR_BLOCK, scriptCmd(0x02, pos, rest), r) || r.data.size() != 12 || sw(r.data) != 0x9000
+				|| (uint32_t) ((r.data[0] << 24) | (r.data[1] << 16) | (r.data[2] << 8) | r.data[3]) != entries
+				|| r.data[4] != 0xFF || r.data[5] != 0xFF || r.data[6] != 0xFF || r.data[7] != 0xFF)
+			return false;
+		for (uint32_t k = entries > 63 ? entries - 63 : 0; k < entries; k++)
+			for (uint32_t j = 0; j < 64; j++)
+				if (se[0].file[(k * 64) % 4032 + j] != (uint8_t) (k * 7 + j))
+					return false;
+		return true;
+	} });
+	w.push_back( { "ping", "FFFF C000: re-attach the SE in session, one S(CIP) exchange", [](uint32_t) {
+		return bytes { 0xFF, 0xFF, 0xC0, 0x00, 0x00 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == 4;
+	} });
+	w.push_back( { "resume", "FFFF C001 S(RELEASE), then GET DATA attaching the SE again", [](uint32_t i) {
+		return i & 1 ? bytes { 0x80, 0xCA, 0x00, 0xFE, 0x00 } : bytes { 0xFF, 0xFF, 0xC0, 0x01 };
+	}, [](uint32_t i, const bytes &r) {
+		return sw(r) == 0x9000 && (!(i & 1) || std::equal(r.begin(), r.end() - 2, sim::SecureElement::chipId));
+	} });
+	w.push_back( { "sign", "PSO: COMPUTE DIGITAL SIGNATURE, 32 byte hash", [](uint32_t i) {
+		bytes a = { 0x00, 0x2A, 0x9E, 0x9A, 0x20 };
+		for (int k = 0; k < 32; k++)
+			a.push_back(i + k);
+		a.push_back(0x00);
+		return a;
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == 66;
+	} });
+	w.push_back( { "keygen", "GENERATE KEY PAIR, 700 ms, CCID time extensions", [](uint32_t) {
+		return bytes { 0x00, 0x46, 0x00, 0x00, 0x00 };
+	}, [](uint32_t, const bytes &r) {
+		return sw(r) == 0x9000 && r.size() == 67 && r[0] == 0x04;
+	} });
+	w.push_back( { "mixed", "GET DATA, every 8th a GENERATE KEY PAIR, with -S 2 on slot 1 beside GET DATA on slot 0", [](uint32_t i) {
+		return i % 8 == 1 ? bytes { 0x00, 0x46, 0x00, 0x00, 0x00 } : bytes { 0x80, 0xCA, 0x00, 0xFE, 0x00 };
+	}, [](uint32_t i, const bytes &r) {
+		if (i % 8 == 1)
+			return sw(r) == 0x9000 && r.size() == 67 && r[0] == 0x04;
+		return sw(r) == 0x9000 && std::equal(r.begin(), r.end() - 2, sim::SecureElement::chipId);
+	}, nullptr, [](uint32_t) { // a key generation arriving while GET DATA executes must not run in its wait
+		if (slots < 2)
+			return true;
+		const uint64_t t0 = sim::now();
+		uint64_t getData = 0;
+		send(XFR_BLOCK, { 0x80, 0xCA, 0x00, 0xFE, 0x00 }, 0);
+		send(XFR_BLOCK, { 0x00, 0x46, 0x00, 0x00, 0x00 }, 1);
+		for (int k = 0; k < 2; k++) {
+			Reply r;
+			if (!receive(r) || sw(r.data) != 0x9000)
+				return false;
+			if (r.slot == 0)
+				getData = sim::now() - t0;
+		}
+		return getData && getData < 10'000'000;
+	} });
+	return w;
+}
+
+// stage histograms and counters read from the device (FFFF C400), the exchanges resetting and reading them included
+static void printStages() {
+	static const char *names[seccid::STAGES] = { "host", "USB rx", "queue", "I2C write", "SE", "I2C read", "exec",
+			"USB tx", "total" };
+	static const char *counters[seccid::STAT_COUNTERS] = { "polls", "write NACKs", "CRC errors", "retransmits", "WTX",
+			"recoveries", "bus tx", "bus rx" };
+	Reply r;
+	if (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC4, 0x00 }, r) || r.data.size() != seccid::Stats::SIZE + 2) {
+		fprintf(stderr, "stage statistics (FFFF C400) failed\n");
+		return;
+	}
+	auto u32 = [&](uint32_t i) {
+		return (uint32_t) (r.data[i * 4] << 24) | (r.data[i * 4 + 1] << 16) | (r.data[i * 4 + 2] << 8) | r.data[i * 4 + 3];
+	};
+	printf("  %-10s %7s %9s %9s %9s\n", "stage", "n", "p50 <us", "p90 <us", "max us");
+	for (uint32_t s = 0; s < seccid::STAGES; s++) {
+		const uint32_t at = seccid::STAT_COUNTERS + s * (1 + STAT_BUCKETS);
+		uint32_t n = 0, p50 = 0, p90 = 0;
+		for (uint32_t b = 0; b < STAT_BUCKETS; b++)
+			n += u32(at + 1 + b);
+		if (!n)
+			continue;
+		for (uint32_t b = 0, k = 0; b < STAT_BUCKETS; b++) { // upper bound of the bucket holding the percentile
+			k += u32(at + 1 + b);
+			if (!p50 && k * 2 >= n)
+				p50 = 1u << b;
+			if (!p90 && k * 10 >= n * 9)
+				p90 = 1u << b;
+		}
+		printf("  %-10s %7u %9u %9u %9u\n", names[s], n, p50, p90, u32(at));
+	}
+	printf(" ");
+	for (uint32_t c = 0; c < seccid::STAT_COUNTERS; c++)
+		printf(" %s %u%s", counters[c], u32(c), c + 1 < seccid::STAT_COUNTERS ? "," : "\n");
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-n count] [-p depth] [-S slots | -P members] [-w workload[,workload...]] [-A us] [-c] [-i us] [-t level] [-D] [-v] [-l]\n"
+			"  -n count     APDUs per workload (default 200)\n"
+			"  -p depth     XfrBlocks sent ahead of the responses (default 1)\n"
+			"  -S slots     CCID slots / secure elements the APDUs are spread over (default 1)\n"
+			"  -P members   secure elements pooled behind slot 0 (FFFF C5xx)\n"
+			"  -w list      workloads to run (default: all)\n"
+			"  -s scale     scale factor for SE execution times (default 1.0)\n"
+			"  -e rate      bit error rate per T=1' frame, both directions (default 0)\n"
+			"  -H rate      probability of a command hanging the SE (default 0)\n"
+			"  -A us        abort a key generation after us, check the slot recovers\n"
+			"  -c           response cache for SELECT, READ BINARY/RECORD, GET DATA (FFFF C8xx)\n"
+			"  -i us        host idle time after each response (default 0)\n"
+			"  -D           device stage latencies and transport counters per workload (FFFF C4xx)\n"
+			"  -t level     firmware trace level (FFFF CAxx): 0 off, 1 errors, 2 APDUs, 3 T=1' blocks\n"
+			"  -v           echo firmware console output\n"
+			"  -l           list workloads\n", argv0);
+}
+
+int main(int argc, char **argv) {
+	uint32_t count = 200, depth = 1, abortAfter = 0, gap = 0, level = 0xFF;
+	bool cache = false, stages = false;
+	const char *only = NULL;
+	std::vector<Workload> all = workloads();
+	sim::SecureElement::Config cfg;
+
+	for (int opt; (opt = getopt(argc, argv, "n:p:S:P:w:s:e:H:A:ci:t:Dvlh")) != -1;) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			depth = std::max(1ul, strtoul(optarg, NULL, 0));
+			break;
+		case 'S':
+			slots = std::min((unsigned long) CFG_TUD_CCID_SLOTS, std::max(1ul, strtoul(optarg, NULL, 0)));
+			break;
+		case 'P':
+			slots = pool = std::min((unsigned long) CFG_TUD_CCID_SLOTS, std::max(1ul, strtoul(optarg, NULL, 0)));
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		case 's':
+			cfg.execScale = strtod(optarg, NULL);
+			break;
+		case 'e':
+			cfg.rxErrors = cfg.txErrors = strtod(optarg, NULL);
+			break;
+		case 'H':
+			cfg.hangs = strtod(optarg, NULL);
+			break;
+		case 'A':
+			abortAfter = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cache = true;
+			break;
+		case 'i':
+			gap = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			level = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			stages = true;
+			break;
+		case 'v':
+			sim::model.verbose = true;
+			break;
+		case 'l':
+			for (Workload &w : all)
+				printf("%-10s %s\n", w.name, w.desc);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	const struct {
+		TwoWire &bus;
+		int sda, scl, pwr;
+	} wiring[] = { { Wire, PIN_WIRE0_SDA, PIN_WIRE0_SCL, SE_POWER_PIN }, { Wire1, PIN_WIRE1_SDA, PIN_WIRE1_SCL, SE1_POWER_PIN } };
+	for (uint32_t s = 0; s < slots; s++) {
+		se[s].cfg = cfg;
+		se[s].cfg.sdaPin = wiring[s].sda, se[s].cfg.sclPin = wiring[s].scl;
+		sim::attach(wiring[s].bus, 0x48, &se[s]);
+		sim::attachPin(wiring[s].sda, &se[s]);
+		sim::attachPin(wiring[s].scl, &se[s]);
+		if (wiring[s].pwr >= 0) {
+			se[s].cfg.pwrPin = wiring[s].pwr;
+			sim::attachPin(wiring[s].pwr, &se[s]);
+		}
+	}
+	const uint64_t plugged = sim::now();
+	sim::startCore1(setup1, loop1); // both cores start together, as on the RP2040
+	setup();
+	sim::usbEnumerate();
+
+	Reply r;
+	const bool on = exchange(ICC_POWER_ON, { }, r);
+	uint8_t tck = 0; // T0 to TCK XOR to 0
+	for (size_t i = 1; on && i < r.data.size(); i++)
+		tck ^= r.data[i];
+	if (!on || r.type != DATA_BLOCK || r.data.size() < 4 || r.data[0] != 0x3B || r.data.size() != 4u + (r.data[1] & 0x0F)
+			|| tck) {
+		fprintf(stderr, "ICC_POWER_ON failed\n");
+		return 1;
+	}
+	const bytes atr = r.data;
+	const uint64_t powered = sim::now();
+	uint32_t resets = 0; // S(SWR) during the initialisation
+	for (uint32_t s = 0; s < slots; s++)
+		resets -= se[s].stats.resets;
+	for (uint32_t s = 0; s < slots; s++) {
+		if (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC0, 0x00, 0x00 }, r, s) || sw(r.data) != 0x9000) {
+			fprintf(stderr, "secure element init (FFFF C000) of slot %u failed\n", s);
+			return 1;
+		}
+	}
+	for (uint32_t s = 0; s < slots; s++)
+		resets += se[s].stats.resets;
+	if (CFG_TUD_CCID_LANES > 1 && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC2, 0x01 }, r) || sw(r.data) != 0x6985)) {
+		fprintf(stderr, "FFFF C201 of slot 0 not rejected, slot 1 addresses the SE on Wire1\n");
+		return 1;
+	}
+	if (sim::model.verbose) { // SEs attached at boot: the first FFFF C000 is a warm S(CIP), no soft reset
+		fprintf(stderr, "boot: ATR");
+		for (uint8_t b : atr)
+			fprintf(stderr, " %2.2X", b);
+		fprintf(stderr, " after %.1f us, %u slot(s) ready after %.1f us, %u soft resets\n", (powered - plugged) / 1e3, slots,
+				(sim::now() - plugged) / 1e3, resets);
+	}
+	if (pool && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC5, (uint8_t) pool, 0x00 }, r) || sw(r.data) != 0x9000)) {
+		fprintf(stderr, "SE pool setup (FFFF C5xx) failed\n");
+		return 1;
+	}
+	if (pool && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xCB, 0x01, 2, 0x84, 0x2A }, r) || sw(r.data) != 0x9000)) {
+		fprintf(stderr, "pooled INS (FFFF CB01) failed\n"); // the simulated PSO needs no MSE, any member signs
+		return 1;
+	}
+	for (uint32_t s = 0; s < CFG_TUD_CCID_SLOTS; s++) { // an ICC exactly where an SE is fitted, notified and polled
+		const bool fitted = s < slots;
+		if (!exchange(GET_SLOT_STATUS, { }, r, s) || r.type != SLOT_STATUS
+				|| ((r.status & 3) != SLOT_STATUS_NO_ICC) != fitted
+				|| (CFG_TUD_CCID_NOTIFY && (bool) (iccState >> (s * 2) & 1) != fitted)) {
+			fprintf(stderr, "slot %u: %s expected\n", s, fitted ? "ICC present" : "no ICC present");
+			return 1;
+		}
+	}
+	if (cache && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC8, 0x01, 5, 0xA4, 0xB0, 0xB2, 0xCA, 0xCB }, r)
+			|| sw(r.data) != 0x9000)) {
+		fprintf(stderr, "response cache setup (FFFF C801) failed\n");
+		return 1;
+	}
+	if (level != 0xFF && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xCA, (uint8_t) level }, r) || sw(r.data) != 0x9000)) {
+		fprintf(stderr, "trace level (FFFF CAxx) failed\n");
+		return 1;
+	}
+	uint32_t clocks[CFG_TUD_CCID_SLOTS], rates[CFG_TUD_CCID_SLOTS];
+	if (sim::usbHostControl(0xA1, REQ_GET_CLOCK_FREQUENCIES, 0, 0, (uint8_t*) clocks, sizeof(clocks)) != sizeof(clocks)
+			|| sim::usbHostControl(0xA1, REQ_GET_DATA_RATES, 0, 0, (uint8_t*) rates, sizeof(rates)) != sizeof(rates)
+			|| clocks[0] != std::min(se[0].i2cMaxClock(), (uint32_t) CCID_MAX_CLOCK_KHZ * 1000) / 1000) {
+		fprintf(stderr, "GET_CLOCK_FREQUENCIES / GET_DATA_RATES failed\n");
+		return 1;
+	}
+	if (sim::model.verbose)
+		for (uint32_t s = 0; s < slots; s++)
+			fprintf(stderr, "slot %u: %u kHz, %u bit/s\n", s, clocks[s], rates[s]);
+	auto stats = [&] { // summed over the SEs in use
+		sim::SecureElement::Stats t = { };
+		for (uint32_t s = 0; s < slots; s++) {
+			t.readNacks += se[s].stats.readNacks, t.writeNacks += se[s].stats.writeNacks;
+			t.txErrors += se[s].stats.txErrors, t.crcErrors += se[s].stats.crcErrors;
+			t.resynchs += se[s].stats.resynchs, t.resets += se[s].stats.resets;
+			t.hangs += se[s].stats.hangs, t.busClears += se[s].stats.busClears;
+			t.powerCycles += se[s].stats.powerCycles;
+		}
+		return t;
+	};
+
+	printf("%-10s %6s %9s %9s %9s %9s %9s %8s %7s\n", "workload", "n", "p50 us", "p90 us", "p99 us", "max us", "APDU/s",
+			"polls", "errors");
+
+	int failed = 0;
+	for (Workload &w : all) {
+		if (only && !strstr(only, w.name))
+			continue;
+
+		std::vector<uint64_t> lat, sentAt(count);
+		std::vector<uint32_t> apduOf(256); // CCID bSeq -> APDU index, responses of different slots may overtake
+		uint32_t errors = 0, mute = 0, nacks = stats().readNacks + stats().writeNacks, ext = timeExt;
+		if (w.begin && !w.begin()) {
+			fprintf(stderr, "%s: session not opened\n", w.name);
+			return 1;
+		}
+		if (stages && (!exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC4, 0x01 }, r) || sw(r.data) != 0x9000)) {
+			fprintf(stderr, "stage statistics (FFFF C401) failed\n");
+			return 1;
+		}
+		uint64_t start = sim::now();
+		auto wall = std::chrono::steady_clock::now();
+
+		for (uint32_t done = 0, sent = 0; done < count; done++) { // keep up to depth XfrBlocks outstanding
+			for (; sent < count && sent - done < depth; sent++) {
+				sentAt[sent] = sim::now();
+				apduOf[ccidSeq] = sent;
+				send(XFR_BLOCK, w.apdu(sent), pool || w.begin ? 0 : sent % slots);
+			}
+			uint32_t i;
+			if (!receive(r) || (i = apduOf[r.seq]) >= sent || sentAt[i] == ~0ull || r.slot != (pool || w.begin ? 0 : i % slots)) {
+				fprintf(stderr, "%s: no valid response to APDU %u\n", w.name, done);
+				return 1;
+			}
+			if (cfg.hangs && r.type == DATA_BLOCK && r.status == SLOT_STATUS_FAILED
+					&& (r.error == ICC_MUTE || r.error == HW_ERROR))
+				mute++; // expected for a hung SE
+			else if (cfg.hangs && w.begin && mute && sw(r.data) == 0x6400)
+				mute++; // session stopped by the hang
+			else if (r.type != DATA_BLOCK || r.status || !w.check(i, r.data))
+				errors++;
+			lat.push_back(sim::now() - sentAt[i]);
+			sentAt[i] = ~0ull; // answered
+			idle(gap * 1000ull);
+		}
+		uint64_t total = sim::now() - start;
+		if (w.end && !w.end(count) && !(cfg.hangs && mute))
+			errors++;
+
+		double wallUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - wall).count();
+		std::sort(lat.begin(), lat.end());
+		auto pct = [&](double p) {
+			return lat[std::min(lat.size() - 1, (size_t) (p * lat.size()))] / 1000.0;
+		};
+		printf("%-10s %6u %9.1f %9.1f %9.1f %9.1f %9.1f %8.1f %7u\n", w.name, count, pct(0.50), pct(0.90), pct(0.99),
+				lat.back() / 1000.0, count * 1e9 / total,
+				(double) (stats().readNacks + stats().writeNacks - nacks) / count, errors);
+		if (sim::model.verbose)
+			fprintf(stderr, "%s: %.2f us host CPU per APDU, %u time extensions, %u slot errors\n", w.name,
+					wallUs / count, timeExt - ext, mute);
+		failed += errors != 0;
+		if (stages)
+			printStages();
+	}
+
+	if (abortAfter) { // key generation aborted by the host, the slot must serve the next APDU
+		const uint8_t seq = ccidSeq;
+		send(XFR_BLOCK, { 0x00, 0x46, 0x00, 0x00, 0x00 });
+		receive(r, abortAfter * 1000ull);
+		const uint64_t t0 = sim::now();
+		sim::usbHostControl(0x21, REQ_ABORT, ccidSeq << 8, 0, NULL, 0);
+		send(ABORT, { });
+		Reply a;
+		if (!receive(r) || r.seq != seq || r.status != SLOT_STATUS_FAILED || r.error != CMD_ABORTED || !receive(a)
+				|| a.type != SLOT_STATUS || a.seq != (uint8_t) (seq + 1) || a.status) {
+			fprintf(stderr, "abort: key generation not aborted\n");
+			return 1;
+		}
+		const uint64_t t1 = sim::now();
+		if (!exchange(XFR_BLOCK, all[0].apdu(0), r) || !all[0].check(0, r.data)) {
+			fprintf(stderr, "abort: slot does not recover\n");
+			return 1;
+		}
+		printf("abort after %u us: answered in %.1f us, next APDU %.1f us\n", abortAfter, (t1 - t0) / 1000.0,
+				(sim::now() - t1) / 1000.0);
+	}
+
+	if (cache && exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xC8, 0x00 }, r) && r.data.size() >= 12)
+		printf("cache: %u hits, %u misses, %u bytes\n", (r.data[0] << 24) | (r.data[1] << 16) | (r.data[2] << 8) | r.data[3],
+				(r.data[4] << 24) | (r.data[5] << 16) | (r.data[6] << 8) | r.data[7], (r.data[8] << 8) | r.data[9]);
+
+	sim::SecureElement::Stats t = stats();
+	if (cfg.rxErrors || cfg.txErrors)
+		printf("SE: %u frames damaged towards the host, %u CRC errors received, %u resynchs, %u resets\n",
+				t.txErrors, t.crcErrors, t.resynchs, t.resets);
+	if (cfg.hangs)
+		printf("SE: %u hangs, recovered by %u bus clears and %u power cycles\n", t.hangs, t.busClears, t.powerCycles);
+	if (sim::model.verbose && exchange(XFR_BLOCK, { 0xFF, 0xFF, 0xCA, 0xFF }, r) && r.data.size() == 7)
+		fprintf(stderr, "trace: level %u, %u records lost\n", r.data[0],
+				(r.data[1] << 24) | (r.data[2] << 16) | (r.data[3] << 8) | r.data[4]);
+	if (sim::model.verbose)
+		fprintf(stderr, "USB: %u NotifySlotChange, %u HardwareError\n", slotChanges, hwErrors);
+	return failed ? 1 : 0;
+}
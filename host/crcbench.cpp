@@ -0,0 +1,98 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * CRC16 micro-benchmark: checks all variants against the CRC-16/X-25 check value and
+ * a bitwise reference, then reports host ns per byte for typical T=1' block sizes.
+ * Wall-clock time of the build machine, not virtual time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <initializer_list>
+
+#include "crc16.h"
+
+using seccid::CRC16;
+
+static uint8_t src[1024], dst[1024];
+static volatile uint16_t sink;
+
+static uint16_t reference(const uint8_t *p, size_t len) {
+	uint16_t crc = 0xFFFF;
+	while (len--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	return ~crc;
+}
+
+template<unsigned SLICES>
+static bool verify() {
+	const uint8_t check[] = "123456789";
+	if (CRC16<SLICES>::compute(check, 9) != 0x906E)
+		return false;
+	for (size_t len = 0; len < sizeof(src); len += 7) {
+		CRC16<SLICES> a, b;
+		a.update(src, len / 3).update(&src[len / 3], len - len / 3);
+		b.copy(dst, src, len);
+		if (a.final() != reference(src, len) || b.final() != a.final() || memcmp(dst, src, len))
+			return false;
+	}
+	return true;
+}
+
+template<typename F>
+static double nsPerByte(size_t len, F f) {
+	const uint32_t rounds = 4'000'000 / (len + 16);
+	auto t0 = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < rounds; i++)
+		f(len);
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / rounds / len;
+}
+
+template<unsigned SLICES>
+static void run(const char *name, size_t table) {
+	if (!verify<SLICES>()) {
+		printf("%-8s FAILED\n", name);
+		return;
+	}
+	printf("%-8s %6zu", name, table);
+	for (size_t len : { 6, 64, 256, 1024 }) {
+		printf(" %9.2f", nsPerByte(len, [](size_t n) {
+			sink = CRC16<SLICES>().update(src, n).final();
+		}));
+	}
+	printf(" %9.2f\n", nsPerByte(256, [](size_t n) {
+		sink = CRC16<SLICES>().copy(dst, src, n).final();
+	}));
+}
+
+int main() {
+	for (size_t i = 0; i < sizeof(src); i++)
+		src[i] = i * 31 + (i >> 3);
+
+	printf("ns/byte   table     6 B      64 B     256 B      1 KB  copy 256\n");
+	run<0>("nibble", 32);
+	run<1>("byte", 512);
+	run<4>("slice4", 2048);
+	run<8>("slice8", 4096);
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _H_HOST_NEOPIXEL_
+#define _H_HOST_NEOPIXEL_
+
+#include "Arduino.h"
+
+class Adafruit_NeoPixel {
+public:
+	Adafruit_NeoPixel(uint16_t n, int16_t pin) {
+		(void) n, (void) pin;
+	}
+	void begin() {
+	}
+	void show() {
+	}
+	void fill(uint32_t c, uint16_t first = 0, uint16_t count = 0) {
+		(void) c, (void) first, (void) count;
+	}
+	static uint32_t Color(uint8_t r, uint8_t g, uint8_t b) {
+		return ((uint32_t) r << 16) | ((uint32_t) g << 8) | b;
+	}
+};
+
+#endif
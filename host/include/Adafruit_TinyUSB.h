@@ -0,0 +1,90 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host stand-in for the Adafruit TinyUSB Arduino wrapper
+ */
+
+#ifndef _H_HOST_ADAFRUIT_TINYUSB_
+#define _H_HOST_ADAFRUIT_TINYUSB_
+
+#include "Arduino.h"
+#include "tusb.h"
+
+class Adafruit_USBD_Interface {
+protected:
+	uint8_t _strid = 0;
+public:
+	virtual ~Adafruit_USBD_Interface() {}
+	virtual uint16_t getInterfaceDescriptor(uint8_t itfnum, uint8_t *buf, uint16_t bufsize) = 0;
+	void setStringDescriptor(const char *str);
+};
+
+class Adafruit_USBD_Device {
+	static const uint8_t MAX_ITF = 4;
+	Adafruit_USBD_Interface *itfs[MAX_ITF] = { };
+	uint8_t itfCount = 0, itfNum = 0, epIn = 1, epOut = 1, strCount = 4;
+	bool mountedFlag = false;
+public:
+	void setID(uint16_t vid, uint16_t pid) {
+		(void) vid, (void) pid;
+	}
+	void setDeviceVersion(uint16_t bcd) {
+		(void) bcd;
+	}
+	void setManufacturerDescriptor(const char *s) {
+		(void) s;
+	}
+	void setProductDescriptor(const char *s) {
+		(void) s;
+	}
+	void setSerialDescriptor(const char *s) {
+		(void) s;
+	}
+
+	bool addInterface(Adafruit_USBD_Interface &itf);
+	void clearConfiguration();
+	uint8_t allocInterface(uint8_t count = 1);
+	uint8_t allocEndpoint(uint8_t in);
+	uint8_t allocString() {
+		return strCount++;
+	}
+	bool mounted() {
+		return mountedFlag;
+	}
+	// simulation access
+	uint8_t interfaceCount() const {
+		return itfCount;
+	}
+	Adafruit_USBD_Interface* interface(uint8_t i) const {
+		return itfs[i];
+	}
+	void setMounted(bool m) {
+		mountedFlag = m;
+	}
+
+	bool attach() {
+		return true;
+	}
+	bool detach() {
+		return true;
+	}
+};
+
+extern Adafruit_USBD_Device TinyUSBDevice;
+
+#endif
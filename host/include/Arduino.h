@@ -0,0 +1,127 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host stand-in for the Arduino core (subset used by seccid)
+ */
+
+#ifndef _H_HOST_ARDUINO_
+#define _H_HOST_ARDUINO_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#define HIGH	(1)
+#define LOW		(0)
+#define INPUT	(0)
+#define OUTPUT	(1)
+
+// Adafruit QT Py RP2040: Wire on the board pads, Wire1 on the STEMMA QT connector
+#define PIN_WIRE0_SDA	(24u)
+#define PIN_WIRE0_SCL	(25u)
+#define PIN_WIRE1_SDA	(22u)
+#define PIN_WIRE1_SCL	(23u)
+
+typedef uint8_t byte;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+uint8_t rp2040_chip_version();
+uint8_t rp2040_rom_version();
+void pico_get_unique_board_id_string(char *id_out, unsigned len);
+
+class String {
+	std::string s;
+public:
+	String(const char *c = "") :
+			s(c) {
+	}
+	const char* c_str() const {
+		return s.c_str();
+	}
+	unsigned length() const {
+		return s.length();
+	}
+	String& operator+=(char c) {
+		s += c;
+		return *this;
+	}
+};
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t len);
+
+	size_t print(const char *str);
+	size_t println(const char *str = "");
+	size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	virtual void flush() {}
+};
+
+class Stream: public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+
+	size_t readBytes(uint8_t *buf, size_t len);
+	String readString();
+};
+
+class SerialUSB: public Stream {
+public:
+	void begin(unsigned long baud = 115200) {
+		(void) baud;
+	}
+	using Print::write;
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t *buf, size_t len) override;
+	int available() override {
+		return 0;
+	}
+	int availableForWrite() {
+		return 64; // CDC FIFO, drained by the host as fast as written
+	}
+	int read() override {
+		return -1;
+	}
+	int peek() override {
+		return -1;
+	}
+	operator bool() {
+		return true;
+	}
+};
+
+extern SerialUSB Serial;
+
+#endif
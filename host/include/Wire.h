@@ -0,0 +1,72 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host stand-in for the RP2040 TwoWire implementation
+ *
+ * Buffer size and return codes follow the arduino-pico core: 256 byte buffers,
+ * endTransmission() returns 0 on success and 2 on address NACK, requestFrom()
+ * returns the requested quantity or 0 on NACK.
+ */
+
+#ifndef _H_HOST_WIRE_
+#define _H_HOST_WIRE_
+
+#include "Arduino.h"
+
+#define WIRE_BUFFER_SIZE (256)
+
+namespace sim {
+class I2CTarget;
+}
+
+class TwoWire: public Stream {
+	uint32_t clock = 100'000;
+	uint8_t txAddr = 0, buff[WIRE_BUFFER_SIZE];
+	size_t buffLen = 0, buffOff = 0;
+	bool txBegun = false;
+
+	sim::I2CTarget *targets[128] = { };
+
+	void transfer(size_t bytes, uint32_t maxClock);
+public:
+	void begin();
+	void end();
+	void setClock(uint32_t hz);
+	uint32_t getClock() const {
+		return clock;
+	}
+
+	void beginTransmission(uint8_t addr);
+	uint8_t endTransmission(bool stopBit = true);
+	size_t requestFrom(uint8_t addr, size_t quantity, bool stopBit = true);
+
+	using Print::write;
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t *buf, size_t len) override;
+	int available() override;
+	int read() override;
+	int peek() override;
+
+	void attach(uint8_t addr, sim::I2CTarget *target) {
+		targets[addr & 0x7F] = target;
+	}
+};
+
+extern TwoWire Wire, Wire1;
+
+#endif
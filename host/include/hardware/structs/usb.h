@@ -0,0 +1,35 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host stand-in for the pico-sdk USB controller register block
+ */
+
+#ifndef _H_HOST_HW_USB_
+#define _H_HOST_HW_USB_
+
+#include <stdint.h>
+
+#define USB_SIE_STATUS_VBUS_DETECTED_BITS (0x00010000u)
+
+typedef struct {
+	uint32_t sie_status;
+} usb_hw_t;
+
+extern usb_hw_t *const usb_hw;
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host stand-in for the TinyUSB device stack (subset used by the CCID driver)
+ *
+ * Names, semantics and return values follow TinyUSB; endpoint transfers are
+ * served by the USB simulation in host/usbsim.cpp.
+ */
+
+#ifndef _H_HOST_TUSB_
+#define _H_HOST_TUSB_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TUD_OPT_HIGH_SPEED		(0)
+#define OSAL_MUTEX_REQUIRED		(0)
+#define OSAL_MUTEX_DEF(_name)	uint8_t _name
+#define CFG_TUSB_MEM_SECTION
+#define CFG_TUSB_MEM_ALIGN		__attribute__((aligned(4)))
+#define TU_ATTR_WEAK			__attribute__((weak))
+#define TU_ATTR_PACKED			__attribute__((packed))
+
+#define TU_GET_3RD_ARG(a, b, c, ...) c
+#define TU_VERIFY_1ARGS(_cond) do { if (!(_cond)) return false; } while (0)
+#define TU_VERIFY_2ARGS(_cond, _ret) do { if (!(_cond)) return _ret; } while (0)
+#define TU_VERIFY(...) TU_GET_3RD_ARG(__VA_ARGS__, TU_VERIFY_2ARGS, TU_VERIFY_1ARGS, _dummy)(__VA_ARGS__)
+#define TU_ASSERT(...) TU_VERIFY(__VA_ARGS__)
+
+#define TU_U16_HIGH(_u16)		((uint8_t) (((_u16) >> 8) & 0x00ff))
+#define TU_U16_LOW(_u16)		((uint8_t) ((_u16) & 0x00ff))
+#define U16_TO_U8S_LE(_u16)		TU_U16_LOW(_u16), TU_U16_HIGH(_u16)
+#define TU_U32_BYTE3(_u32)		((uint8_t) ((((uint32_t) _u32) >> 24) & 0x000000ff))
+#define TU_U32_BYTE2(_u32)		((uint8_t) ((((uint32_t) _u32) >> 16) & 0x000000ff))
+#define TU_U32_BYTE1(_u32)		((uint8_t) ((((uint32_t) _u32) >>  8) & 0x000000ff))
+#define TU_U32_BYTE0(_u32)		((uint8_t) (((uint32_t)  _u32)        & 0x000000ff))
+#define U32_TO_U8S_LE(_u32)		TU_U32_BYTE0(_u32), TU_U32_BYTE1(_u32), TU_U32_BYTE2(_u32), TU_U32_BYTE3(_u32)
+
+enum {
+	TUSB_DESC_DEVICE = 0x01,
+	TUSB_DESC_CONFIGURATION = 0x02,
+	TUSB_DESC_STRING = 0x03,
+	TUSB_DESC_INTERFACE = 0x04,
+	TUSB_DESC_ENDPOINT = 0x05,
+	TUSB_DESC_DEVICE_QUALIFIER = 0x06,
+};
+
+enum {
+	TUSB_CLASS_SMART_CARD = 0x0B,
+};
+
+typedef enum {
+	TUSB_XFER_CONTROL = 0,
+	TUSB_XFER_ISOCHRONOUS,
+	TUSB_XFER_BULK,
+	TUSB_XFER_INTERRUPT
+} tusb_xfer_type_t;
+
+typedef enum {
+	TUSB_DIR_OUT = 0,
+	TUSB_DIR_IN = 1,
+	TUSB_DIR_IN_MASK = 0x80
+} tusb_dir_t;
+
+typedef enum {
+	XFER_RESULT_SUCCESS = 0,
+	XFER_RESULT_FAILED,
+	XFER_RESULT_STALLED,
+	XFER_RESULT_TIMEOUT,
+	XFER_RESULT_INVALID
+} xfer_result_t;
+
+typedef enum {
+	TUSB_REQ_TYPE_STANDARD = 0,
+	TUSB_REQ_TYPE_CLASS,
+	TUSB_REQ_TYPE_VENDOR,
+	TUSB_REQ_TYPE_INVALID
+} tusb_request_type_t;
+
+typedef enum {
+	TUSB_REQ_RCPT_DEVICE = 0,
+	TUSB_REQ_RCPT_INTERFACE,
+	TUSB_REQ_RCPT_ENDPOINT,
+	TUSB_REQ_RCPT_OTHER
+} tusb_request_recipient_t;
+
+enum {
+	CONTROL_STAGE_IDLE = 0,
+	CONTROL_STAGE_SETUP,
+	CONTROL_STAGE_DATA,
+	CONTROL_STAGE_ACK
+};
+
+typedef struct TU_ATTR_PACKED {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bInterfaceNumber;
+	uint8_t bAlternateSetting;
+	uint8_t bNumEndpoints;
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t iInterface;
+} tusb_desc_interface_t;
+
+typedef struct TU_ATTR_PACKED {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bEndpointAddress;
+	struct TU_ATTR_PACKED {
+		uint8_t xfer :2;
+		uint8_t sync :2;
+		uint8_t usage :2;
+		uint8_t :2;
+	} bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t bInterval;
+} tusb_desc_endpoint_t;
+
+typedef struct TU_ATTR_PACKED {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint8_t bNumConfigurations;
+	uint8_t bReserved;
+} tusb_desc_device_qualifier_t;
+
+typedef struct TU_ATTR_PACKED {
+	union {
+		struct TU_ATTR_PACKED {
+			uint8_t recipient :5;
+			uint8_t type :2;
+			uint8_t direction :1;
+		} bmRequestType_bit;
+		uint8_t bmRequestType;
+	};
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} tusb_control_request_t;
+
+static inline uint8_t tu_desc_len(void const *desc) {
+	return ((uint8_t const*) desc)[0];
+}
+
+static inline uint8_t tu_desc_type(void const *desc) {
+	return ((uint8_t const*) desc)[1];
+}
+
+static inline uint8_t const* tu_desc_next(void const *desc) {
+	uint8_t const *d = (uint8_t const*) desc;
+	return d + d[0];
+}
+
+static inline tusb_dir_t tu_edpt_dir(uint8_t addr) {
+	return (addr & TUSB_DIR_IN_MASK) ? TUSB_DIR_IN : TUSB_DIR_OUT;
+}
+
+#define tu_memclr(buffer, size) memset((buffer), 0, (size))
+
+//--------------------------------------------------------------------+
+// FIFO
+//--------------------------------------------------------------------+
+typedef struct {
+	uint8_t *buffer;
+	uint16_t depth;
+	uint16_t item_size;
+	bool overwritable;
+	volatile uint32_t wr_idx;
+	volatile uint32_t rd_idx;
+} tu_fifo_t;
+
+bool tu_fifo_config(tu_fifo_t *f, void *buffer, uint16_t depth, uint16_t item_size, bool overwritable);
+bool tu_fifo_clear(tu_fifo_t *f);
+uint16_t tu_fifo_count(tu_fifo_t *f);
+uint16_t tu_fifo_remaining(tu_fifo_t *f);
+uint16_t tu_fifo_read_n(tu_fifo_t *f, void *buffer, uint16_t n);
+uint16_t tu_fifo_write_n(tu_fifo_t *f, void const *data, uint16_t n);
+
+//--------------------------------------------------------------------+
+// USBD class driver API
+//--------------------------------------------------------------------+
+typedef struct {
+	char const *name;
+	void (*init)(void);
+	bool (*deinit)(void);
+	void (*reset)(uint8_t rhport);
+	uint16_t (*open)(uint8_t rhport, tusb_desc_interface_t const *desc_intf, uint16_t max_len);
+	bool (*control_xfer_cb)(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request);
+	bool (*xfer_cb)(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes);
+	void (*sof)(uint8_t rhport, uint32_t frame_count);
+} usbd_class_driver_t;
+
+bool usbd_open_edpt_pair(uint8_t rhport, uint8_t const *p_desc, uint8_t ep_count, uint8_t xfer_type, uint8_t *ep_out, uint8_t *ep_in);
+bool usbd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const *desc_ep);
+bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr);
+bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr);
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes);
+bool usbd_edpt_busy(uint8_t rhport, uint8_t ep_addr);
+bool tud_control_xfer(uint8_t rhport, tusb_control_request_t const *request, void *buffer, uint16_t len);
+bool tud_control_status(uint8_t rhport, tusb_control_request_t const *request);
+bool tud_mounted(void);
+
+usbd_class_driver_t const* usbd_app_driver_get_cb(uint8_t *driver_count);
+
+#endif
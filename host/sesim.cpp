@@ -0,0 +1,362 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "sesim.h"
+
+namespace sim {
+
+const uint8_t SecureElement::chipId[18] = { 0x04, 0x00, 0x50, 0x01, 0xA8, 0xFA, 0x53, 0x45, 0x30, 0x35, 0x31, 0x43,
+		0x32, 0x00, 0x07, 0x00, 0x07, 0x01 };
+
+uint16_t SecureElement::crc(const uint8_t *p, size_t len) { // CRC-16/X-25 as used by T=1', transmitted MSB first
+	uint16_t crc = 0xFFFF;
+	while (len--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	return ~crc;
+}
+
+SecureElement::SecureElement() {
+	for (uint32_t i = 0; i < FILE_SZ; i++)
+		file[i] = (uint8_t) (i * 7 + 3);
+}
+
+std::vector<uint8_t> SecureElement::cip() const {
+	std::vector<uint8_t> c = { 0x01, // PVER
+			0x04, 0x00, 0x04, 0x60, 0x05, // IIN
+			0x02, // PLID: I2C
+			0x0C, 0x00, (uint8_t) (cfg.mcfKhz >> 8), (uint8_t) cfg.mcfKhz, 0x00, cfg.mpot, 0x00, 0x00, 0x00, //
+			(uint8_t) (cfg.segtUs >> 8), (uint8_t) cfg.segtUs, (uint8_t) (cfg.wutUs >> 8), (uint8_t) cfg.wutUs, //
+			0x04, (uint8_t) (cfg.bwtMs >> 8), (uint8_t) cfg.bwtMs, (uint8_t) (cfg.ifsc >> 8), (uint8_t) cfg.ifsc, // DLLP
+			0x0A, 'S', 'E', '0', '5', '1', 'C', '2', 'S', 'I', 'M' };
+	return c;
+}
+
+void SecureElement::frame(uint8_t pcb, const uint8_t *inf, size_t len, uint64_t delayNs) {
+	out.assign( { 0x12, pcb, (uint8_t) (len >> 8), (uint8_t) len });
+	out.insert(out.end(), inf, inf + len);
+	uint16_t c = crc(out.data(), out.size());
+	out.push_back(c >> 8);
+	out.push_back(c);
+	lastOut = out;
+	arm(delayNs);
+}
+
+void SecureElement::arm(uint64_t delayNs) { // out is ready to be read after delayNs
+	outOff = 0;
+	readyAt = busyUntil = now() + delayNs;
+	corruptAt = fault(cfg.txErrors) ? faultRng % out.size() : -1;
+	stats.framesTx++;
+}
+
+bool SecureElement::fault(double p) {
+	if (p <= 0)
+		return false;
+	faultRng ^= faultRng << 13, faultRng ^= faultRng >> 17, faultRng ^= faultRng << 5;
+	return faultRng < p * 4294967296.0;
+}
+
+void SecureElement::nextBlock(uint64_t delayNs) { // next I-block of the current response
+	size_t n = rsp.size() - rspOff > ifsd ? ifsd : rsp.size() - rspOff;
+	bool more = rspOff + n < rsp.size();
+	frame((sendSeq << 6) | (more ? 0x20 : 0), &rsp[rspOff], n, delayNs);
+	lastI = out;
+	sendSeq ^= 1;
+	rspOff += n;
+}
+
+void SecureElement::rblock(uint8_t err) {
+	frame(0x80 | (recvSeq << 4) | err, NULL, 0, cfg.frameNs);
+}
+
+bool SecureElement::i2cWrite(const uint8_t *buf, size_t len) {
+	if (now() < busyUntil || hung || !powered()) {
+		stats.writeNacks++;
+		return false;
+	}
+	if (!len) // address probe
+		return true;
+	stats.framesRx++;
+
+	if (len < 6 || buf[0] != 0x21 || (size_t) ((buf[2] << 8) | buf[3]) + 6 != len
+			|| crc(buf, len - 2) != ((buf[len - 2] << 8) | buf[len - 1]) || fault(cfg.rxErrors)) {
+		stats.crcErrors++;
+		rblock(0x01); // EDC or parity error
+		return true;
+	}
+
+	const uint8_t pcb = buf[1], *inf = &buf[4];
+	const size_t lc = len - 6;
+
+	if (!(pcb & 0x80)) { // I-block
+		if (((pcb >> 6) & 1) != recvSeq || lc > cfg.ifsc) {
+			rblock(0x02); // other error
+			return true;
+		}
+		recvSeq ^= 1;
+		cmd.insert(cmd.end(), inf, inf + lc);
+		if (pcb & 0x20) { // more data, acknowledge
+			rblock(0);
+			return true;
+		}
+		if (fault(cfg.hangs)) { // command received, never answered
+			hung = 1 + (stats.hangs++ & 1);
+			return true;
+		}
+
+		uint64_t exec = execute();
+		cmd.clear();
+		rspOff = 0;
+		if (cfg.wtx && exec > cfg.bwtMs * 1'000'000ull) {
+			uint8_t mult = (exec + cfg.bwtMs * 1'000'000ull - 1) / (cfg.bwtMs * 1'000'000ull);
+			wtxRemaining = exec - cfg.bwtMs * 1'000'000ull;
+			frame(0xC3, &mult, 1, cfg.bwtMs * 1'000'000ull);
+			stats.wtx++;
+		} else {
+			nextBlock(exec);
+		}
+	} else if ((pcb & 0xC0) == 0x80) { // R-block
+		if (((pcb >> 4) & 1) == sendSeq && rspOff < rsp.size()) { // next block of a chained response
+			nextBlock(cfg.frameNs);
+		} else { // N(R) of our last I-block: repeat that one, otherwise the last block
+			out = ((pcb >> 4) & 1) != sendSeq && !lastI.empty() ? lastI : lastOut;
+			arm(cfg.frameNs);
+		}
+	} else { // S-block
+		switch (pcb) {
+		case 0xC0: // RESYNCH
+			stats.resynchs++;
+			sendSeq = recvSeq = 0;
+			cmd.clear(), rsp.clear(), lastI.clear();
+			frame(0xE0, NULL, 0, cfg.frameNs);
+			break;
+		case 0xC1: // IFS
+			if (lc == 1 || lc == 2) {
+				ifsd = lc == 1 ? inf[0] : (inf[0] << 8) | inf[1];
+				frame(0xE1, inf, lc, cfg.frameNs);
+			} else {
+				rblock(0x02);
+			}
+			break;
+		case 0xC2: // ABORT
+			cmd.clear(), rsp.clear();
+			frame(0xE2, NULL, 0, cfg.frameNs);
+			break;
+		case 0xC4: { // CIP
+			std::vector<uint8_t> c = cip();
+			frame(0xE4, c.data(), c.size(), cfg.frameNs);
+			break;
+		}
+		case 0xC5: // RELEASE
+			frame(0xE5, NULL, 0, cfg.frameNs);
+			break;
+		case 0xCF: { // SWR
+			std::vector<uint8_t> c = cip();
+			sendSeq = recvSeq = 0;
+			ifsd = 254;
+			cmd.clear(), rsp.clear(), lastI.clear();
+			stats.resets++;
+			frame(0xEF, c.data(), c.size(), cfg.resetNs);
+			break;
+		}
+		case 0xE3: // WTX response
+			if (wtxRemaining) {
+				uint64_t exec = wtxRemaining;
+				wtxRemaining = 0;
+				nextBlock(exec);
+				break;
+			}
+			/* no break */
+		default:
+			rblock(0x02);
+			break;
+		}
+	}
+	return true;
+}
+
+size_t SecureElement::i2cRead(uint8_t *buf, size_t len) {
+	if (now() < readyAt || outOff >= out.size() || hung || !powered()) {
+		stats.readNacks++;
+		return 0;
+	}
+
+	size_t n = out.size() - outOff < len ? out.size() - outOff : len;
+	memcpy(buf, &out[outOff], n);
+	if (corruptAt >= (int32_t) outOff && corruptAt < (int32_t) (outOff + n)) {
+		buf[corruptAt - outOff] ^= 1 << (faultRng >> 29);
+		stats.txErrors++;
+	}
+	memset(&buf[n], 0xFF, len - n);
+	outOff += n;
+	if (outOff >= out.size())
+		busyUntil = now() + cfg.segtUs * 1000ull;
+	return len;
+}
+
+void SecureElement::pinWrite(uint8_t pin, uint8_t val) {
+	if (pin == cfg.sclPin && val && hung == 1 && ++sclPulses >= 9) { // byte clocked out, SDA released
+		hung = sclPulses = 0;
+		stats.busClears++;
+	}
+	if (pin == cfg.pwrPin && !val) { // supply off: all state is lost
+		supply = 0;
+		hung = sclPulses = 0;
+		sendSeq = recvSeq = 0;
+		cmd.clear(), rsp.clear(), out.clear(), lastOut.clear(), lastI.clear();
+	} else if (pin == cfg.pwrPin && supply != 1) {
+		if (!supply) // switched off before, not the first power-up
+			stats.powerCycles++;
+		supply = 1;
+		busyUntil = now() + cfg.wutUs * 1000ull;
+	}
+}
+
+int SecureElement::pinRead(uint8_t pin) {
+	return pin == cfg.sdaPin && hung == 1 ? 0 : -1;
+}
+
+uint64_t SecureElement::execute() {
+	const uint8_t *a = cmd.data();
+	const size_t len = cmd.size();
+	size_t lc = 0, ne = 0;
+	const uint8_t *data = NULL;
+	uint64_t ns = 50'000;
+	uint16_t sw = 0x9000;
+
+	stats.apdus++;
+	rsp.clear();
+	if (len < 2 || a[1] != 0xC0) // GET RESPONSE must follow immediately
+		left.clear();
+
+	// ISO 7816-4 cases 1, 2S/E, 3S/E, 4S/E
+	bool valid = len >= 4;
+	if (len == 5) {
+		ne = a[4] ? a[4] : 256;
+	} else if (len > 5 && a[4]) {
+		lc = a[4], data = &a[5];
+		valid = len == 5 + lc || len == 6 + lc;
+		if (len == 6 + lc)
+			ne = a[5 + lc] ? a[5 + lc] : 256;
+	} else if (len == 7) {
+		ne = (a[5] << 8) | a[6];
+		ne = ne ? ne : 65536;
+	} else if (len > 7) {
+		lc = (a[5] << 8) | a[6], data = &a[7];
+		valid = lc && (len == 7 + lc || len == 9 + lc);
+		if (len == 9 + lc) {
+			ne = (a[7 + lc] << 8) | a[8 + lc];
+			ne = ne ? ne : 65536;
+		}
+	}
+
+	if (!valid) {
+		sw = 0x6700;
+	} else {
+		const uint16_t off = ((a[2] << 8) | a[3]) & 0x7FFF;
+		switch (a[1]) {
+		case 0xA4: // SELECT
+			ns = 300'000;
+			if (ne) {
+				rsp.insert(rsp.end(), { 0x6F, (uint8_t) (lc + 4), 0x84, (uint8_t) lc });
+				rsp.insert(rsp.end(), data, data + lc);
+				rsp.insert(rsp.end(), { 0xA5, 0x00 });
+			}
+			break;
+		case 0xCA: // GET DATA
+			ns = 200'000;
+			if (off == 0x0101) { // 900 byte object, by GET RESPONSE only
+				ns += 900 * 500;
+				left.assign(file, file + 900);
+				sw = 0x6100;
+			} else if (ne && ne < sizeof(chipId)) {
+				sw = 0x6C00 | sizeof(chipId);
+			} else {
+				rsp.insert(rsp.end(), chipId, chipId + sizeof(chipId));
+			}
+			break;
+		case 0xC0: // GET RESPONSE
+			if (left.empty()) {
+				sw = 0x6985;
+			} else {
+				size_t n = left.size() < ne ? left.size() : ne;
+				ns = 50'000 + n * 500;
+				rsp.insert(rsp.end(), left.begin(), left.begin() + n);
+				left.erase(left.begin(), left.begin() + n);
+				sw = left.empty() ? 0x9000 : 0x6100 | (left.size() > 0xFF ? 0 : left.size());
+			}
+			break;
+		case 0x84: // GET CHALLENGE
+			ns = 100'000 + ne * 1'000;
+			for (size_t i = 0; i < ne; i++) {
+				rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5;
+				rsp.push_back(rng);
+			}
+			challenge = rsp;
+			break;
+		case 0x82: // EXTERNAL AUTHENTICATE, against the last challenge
+			ns = 200'000;
+			if (!lc || lc != challenge.size() || memcmp(data, challenge.data(), lc))
+				sw = 0x6982;
+			challenge.clear();
+			break;
+		case 0xB0: // READ BINARY
+			if (off >= FILE_SZ) {
+				sw = 0x6B00;
+			} else {
+				size_t n = FILE_SZ - off < ne ? FILE_SZ - off : ne;
+				ns = 150'000 + n * 500;
+				rsp.insert(rsp.end(), &file[off], &file[off + n]);
+				sw = n < ne ? 0x6282 : 0x9000;
+			}
+			break;
+		case 0xD6: // UPDATE BINARY
+			if (off + lc > FILE_SZ) {
+				sw = 0x6B00;
+			} else {
+				ns = 1'000'000 + lc * 5'000;
+				memcpy(&file[off], data, lc);
+			}
+			break;
+		case 0x2A: // PSO: COMPUTE DIGITAL SIGNATURE
+			ns = 35'000'000;
+			for (size_t i = 0; i < 64; i++)
+				rsp.push_back(lc ? data[i % lc] ^ i : i);
+			break;
+		case 0x46: // GENERATE KEY PAIR
+			ns = 700'000'000;
+			for (size_t i = 0; i < 65; i++) {
+				rng ^= rng << 13, rng ^= rng >> 17, rng ^= rng << 5;
+				rsp.push_back(i ? rng : 0x04);
+			}
+			break;
+		default:
+			sw = 0x6D00;
+			break;
+		}
+	}
+
+	rsp.push_back(sw >> 8);
+	rsp.push_back(sw);
+	return ns * cfg.execScale;
+}
+
+} // end namespace
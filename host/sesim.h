@@ -0,0 +1,117 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * simulated GPC_SPE_172 (T=1' over I2C) secure element
+ *
+ * The SE NACKs its address while it is busy (processing a frame, resetting or
+ * observing the guard time), answers S(SWR) and S(CIP) with its Communication
+ * Interface Parameters, chains I-blocks in both directions and requests waiting
+ * time extensions for commands running longer than BWT. Bit errors can be injected
+ * in both directions to exercise the host's T=1' error recovery, and hangs for the
+ * recovery ladder: the SE either holds SDA low until SCL is clocked, or its firmware
+ * stops answering until the supply pin is cycled.
+ *
+ * CIP layout as emitted here:
+ *   PVER | IIN len, IIN | PLID (0x02 = I2C) | PLP len, PLP | DLLP len, DLLP | HB len, HB
+ *   PLP  = RFU(1) MCF(2, kHz) CONFIG(1) MPOT(1, 100 us) RFU(3) SEGT(2, us) WUT(2, us)
+ *   DLLP = BWT(2, ms) IFSC(2)
+ *
+ * The applet behind the transport serves a small command set with per-command
+ * execution times: SELECT, GET DATA, GET CHALLENGE, READ/UPDATE BINARY on a 4 KB
+ * file, a PSO signature and a slow key pair generation. GET DATA answers too short
+ * an Le with 6Cxx, and delivers its large object (P1P2 0101) by 61xx/GET RESPONSE.
+ */
+
+#ifndef _H_SESIM_
+#define _H_SESIM_
+
+#include <vector>
+
+#include "sim.h"
+
+namespace sim {
+
+class SecureElement: public I2CTarget, public PinTarget {
+public:
+	struct Config {
+		uint16_t ifsc = 254;			// maximum information field the SE accepts
+		uint16_t bwtMs = 1000;			// block waiting time
+		uint8_t mpot = 1;				// minimum polling time, 100 us units
+		uint16_t mcfKhz = 3400;			// maximum clock frequency
+		uint16_t segtUs = 10;			// guard time after a frame has been read
+		uint16_t wutUs = 1000;			// wake-up time
+		uint32_t frameNs = 40'000;		// handling time for control blocks and chained I-blocks
+		uint32_t resetNs = 5'000'000;	// soft reset
+		double execScale = 1.0;			// scale factor for applet execution times
+		bool wtx = true;				// request S(WTX) when execution exceeds BWT
+		double rxErrors = 0;			// probability of a received frame failing the CRC check
+		double txErrors = 0;			// probability of a bit error in a sent frame
+		double hangs = 0;				// probability of a command hanging the SE, alternately bus and firmware
+		uint8_t sdaPin = 0xFF, sclPin = 0xFF, pwrPin = 0xFF; // GPIOs the SE is wired to, 0xFF: none
+	} cfg;
+
+	struct Stats {
+		uint32_t apdus, framesRx, framesTx, writeNacks, readNacks, crcErrors, wtx, resets, resynchs, txErrors;
+		uint32_t hangs, busClears, powerCycles;
+	} stats = { };
+
+	static const uint32_t FILE_SZ = 4096;
+	uint8_t file[FILE_SZ];
+
+	SecureElement();
+
+	bool i2cWrite(const uint8_t *buf, size_t len) override;
+	size_t i2cRead(uint8_t *buf, size_t len) override;
+	uint32_t i2cMaxClock() override {
+		return cfg.mcfKhz * 1000u;
+	}
+	void pinWrite(uint8_t pin, uint8_t val) override;
+	int pinRead(uint8_t pin) override;
+
+	// GET DATA response and GET CHALLENGE generator, exposed for verification
+	static const uint8_t chipId[18];
+	static uint16_t crc(const uint8_t *p, size_t len);
+
+	std::vector<uint8_t> cip() const;
+
+private:
+	uint8_t sendSeq = 0, recvSeq = 0;
+	uint8_t hung = 0, sclPulses = 0; // 1: holding SDA low, 2: firmware stuck
+	int8_t supply = -1; // level driven on cfg.pwrPin, -1: never driven, the supply switch is off
+	bool powered() const {
+		return cfg.pwrPin < 0 || supply > 0;
+	}
+	uint16_t ifsd = 254;
+	uint32_t rng = 0x2545F491, faultRng = 0x9E3779B9;
+	int32_t corruptAt = -1; // byte of out flipped on the bus
+	uint64_t busyUntil = 0, readyAt = 0, wtxRemaining = 0;
+	std::vector<uint8_t> cmd, rsp, out, lastOut, lastI, left; // left: response data for GET RESPONSE
+	std::vector<uint8_t> challenge; // of the last GET CHALLENGE, for EXTERNAL AUTHENTICATE
+	size_t rspOff = 0, outOff = 0;
+
+	void frame(uint8_t pcb, const uint8_t *inf, size_t len, uint64_t delayNs);
+	void nextBlock(uint64_t delayNs);
+	void rblock(uint8_t err);
+	void arm(uint64_t delayNs);
+	bool fault(double p);
+	uint64_t execute();
+};
+
+} // end namespace
+
+#endif
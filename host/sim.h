@@ -0,0 +1,106 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host simulation control
+ *
+ * All time on the host build is virtual: millis()/micros() read a simulated clock
+ * which is advanced by delay(), by bus transfers (I2C bit times, USB packet times)
+ * and by modelled CPU costs (console output, clock reads). Latencies reported by
+ * the benchmark are therefore deterministic and independent of the build machine.
+ *
+ * With startCore1() setup1()/loop1() run on a second thread with its own clock. The
+ * threads are scheduled cooperatively in virtual time: whichever core is behind runs,
+ * so both cores observe each other's effects in causal order and runs stay repeatable.
+ */
+
+#ifndef _H_SIM_
+#define _H_SIM_
+
+#include <stddef.h>
+#include <stdint.h>
+
+class TwoWire;
+
+namespace sim {
+
+// virtual clock in nanoseconds
+uint64_t now();
+void advance(uint64_t ns);
+
+// run setup1() and loop1() as core 1 on a second thread
+void startCore1(void (*setup1)(), void (*loop1)());
+
+// model parameters, may be changed before setup()
+struct Model {
+	uint32_t clockReadNs = 100;		// cost of a millis()/micros() call, guarantees progress in spin loops
+	uint32_t printCallNs = 4000;	// per Serial.print*/printf call (formatting, CDC FIFO)
+	uint32_t printCharNs = 100;		// per character written to Serial
+	uint32_t i2cCallNs = 2000;		// software overhead per I2C transaction
+	uint32_t usbBitNs = 84;			// full speed, 12 MBit/s
+	uint32_t usbPktOverhead = 13;	// token, handshake, CRC, sync bytes per packet
+	uint32_t usbIdleNs = 1000;		// time passed per idle usbTask() call
+	uint32_t core1IdleNs = 1000;	// time passed per loop1() call
+	uint32_t enumerateNs = 20'000'000;	// bus reset to SET_CONFIGURATION by the host
+	bool verbose = false;			// echo Serial output to stderr
+};
+extern Model model;
+
+// I2C target device attached to a simulated bus
+class I2CTarget {
+public:
+	virtual ~I2CTarget() {}
+	// write transaction, return false to NACK the address
+	virtual bool i2cWrite(const uint8_t *buf, size_t len) = 0;
+	// read transaction, return 0 to NACK the address, otherwise fill len bytes
+	virtual size_t i2cRead(uint8_t *buf, size_t len) = 0;
+	// maximum clock supported by the target in Hz
+	virtual uint32_t i2cMaxClock() {
+		return 1'000'000;
+	}
+};
+
+void attach(TwoWire &bus, uint8_t addr, I2CTarget *target);
+
+// device connected to GPIO pins, e.g. the I2C lines or a supply switch
+class PinTarget {
+public:
+	virtual ~PinTarget() {}
+	// level written to an output pin
+	virtual void pinWrite(uint8_t pin, uint8_t val) = 0;
+	// level the device drives onto pin, -1 if it leaves the pin alone
+	virtual int pinRead(uint8_t pin) {
+		(void) pin;
+		return -1;
+	}
+};
+
+void attachPin(uint8_t pin, PinTarget *target);
+
+// USB host side
+void usbEnumerate();						// configure and open all registered class drivers
+void usbHostSend(const uint8_t *buf, uint32_t len);	// queue one bulk OUT transfer
+uint32_t usbHostReceive(uint8_t *buf, uint32_t len);	// fetch bytes received on bulk IN
+uint32_t usbHostPending();					// bytes received on bulk IN not fetched yet
+uint32_t usbHostNotification(uint8_t *buf, uint32_t len);	// fetch the next interrupt IN transfer, 0: none
+int32_t usbHostControl(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *buf,
+		uint16_t len);								// control request on endpoint 0, data stage length or -1: stalled
+void usbTask();								// device stack task, delivers/completes one transfer step
+
+} // end namespace
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * decoder of the binary trace (trace.h) written to the CDC serial port
+ *
+ * Reads the serial stream from a file or stdin, e.g. cat /dev/ttyACM0 | tracedump, and prints
+ * one line per record. Bytes outside valid frames are copied through as text.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "trace.h"
+
+using namespace seccid;
+
+static const char *NAMES[TRACE_EVENTS] = { "lost", "APDU", "rsp", "aborted", "T1 error", "T1 failed", "recovery",
+		"block", "random", "SE CIP", "SE failed" };
+static const char *STATES[] = { "no SE at the address", "S(IFS) failed", "active", "released", "soft reset failed" };
+
+static uint16_t u16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static void print(const trace_rec_t &r, uint32_t n) {
+	printf("%10.6f ", r.us / 1e6);
+	if (r.id >= TRACE_EVENTS) {
+		printf("event %u src %2.2X arg %d\n", r.id, r.src, r.arg);
+		return;
+	}
+	printf("%-9s ", NAMES[r.id]);
+	switch (r.id) {
+	case TRACE_LOST:
+		printf("%d records\n", r.arg);
+		return;
+	case TRACE_APDU:
+		printf("SE%u %4.4X Nc %4.4X ", r.src, r.len, r.arg);
+		break;
+	case TRACE_RSP:
+		printf("SE%u %4.4X SW %4.4X ", r.src, r.len, r.arg & 0xFFFF);
+		break;
+	case TRACE_T1_FAIL:
+		printf("%2.2X %s, %s\n", r.src, r.arg & 1 ? "timed out" : "failed", r.arg & 2 ? "recover" : "recover and repeat");
+		return;
+	case TRACE_T1_RECOVER:
+		printf("%2.2X step %d failed\n", r.src, r.arg);
+		return;
+	case TRACE_T1_BLOCK:
+		printf("%2.2X ", r.src);
+		break;
+	case TRACE_SE_CIP:
+		if (n < 12)
+			break;
+		printf("SE%u PVER %2.2X IFSC %4.4X MCF %u kHz MPOT %u us BWT %u ms WUT %u us, %d historical bytes\n", r.src,
+				u16(r.data), u16(&r.data[2]), u16(&r.data[4]), u16(&r.data[6]) * 100, u16(&r.data[8]), u16(&r.data[10]),
+				r.arg);
+		return;
+	case TRACE_SE_FAIL:
+		printf("SE%u %s\n", r.src, r.arg >= 0 && r.arg < (int32_t) (sizeof(STATES) / sizeof(STATES[0])) ? STATES[r.arg] : "?");
+		return;
+	default:
+		printf("SE%u %d\n", r.src, r.arg);
+		return;
+	}
+	for (uint32_t i = 0; i < n; i++)
+		printf("%2.2X", r.data[i]);
+	printf("%s\n", n < r.len ? ".." : "");
+}
+
+int main(int argc, char **argv) {
+	FILE *in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	std::vector<uint8_t> buf;
+	size_t p = 0;
+	for (bool eof = false; !eof || p < buf.size();) {
+		uint8_t chunk[4096];
+		const ssize_t got = eof ? 0 : read(fileno(in), chunk, sizeof(chunk)); // as it arrives from a tty
+		eof |= got <= 0;
+		buf.insert(buf.end(), chunk, chunk + (got > 0 ? got : 0));
+
+		while (p < buf.size()) {
+			if (buf[p] != TRACE_SYNC) {
+				putchar(buf[p++]);
+				continue;
+			}
+			if (p + 2 > buf.size() && !eof)
+				break;
+			const uint32_t n = p + 1 < buf.size() ? buf[p + 1] : 0;
+			if (n >= TRACE_HDR && n <= TRACE_HDR + TRACE_DATA && p + n + 4 > buf.size() && !eof)
+				break; // rest of the frame still to come
+			trace_rec_t r = { };
+			if (n < TRACE_HDR || n > TRACE_HDR + TRACE_DATA || p + n + 4 > buf.size()
+					|| CRC16<>::compute(&buf[p + 1], n + 1) != ((buf[p + n + 2] << 8) | buf[p + n + 3])) {
+				putchar(buf[p++]); // not a frame
+				continue;
+			}
+			memcpy(&r, &buf[p + 2], n);
+			print(r, n - TRACE_HDR);
+			p += n + 4;
+		}
+		fflush(stdout);
+		buf.erase(buf.begin(), buf.begin() + p);
+		p = 0;
+	}
+	return 0;
+}
@@ -0,0 +1,341 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * host simulation of the TinyUSB device stack and the USB host side
+ *
+ * Endpoint transfers follow TinyUSB semantics: an OUT transfer completes when the
+ * requested length is filled or a short packet arrives, an IN transfer is sent as
+ * packets of wMaxPacketSize. Every packet advances the virtual clock by its wire time.
+ */
+
+#include <deque>
+#include <vector>
+
+#include "Adafruit_TinyUSB.h"
+#include "sim.h"
+
+Adafruit_USBD_Device TinyUSBDevice;
+
+//--------------------------------------------------------------------+
+// FIFO
+//--------------------------------------------------------------------+
+bool tu_fifo_config(tu_fifo_t *f, void *buffer, uint16_t depth, uint16_t item_size, bool overwritable) {
+	f->buffer = (uint8_t*) buffer;
+	f->depth = depth;
+	f->item_size = item_size;
+	f->overwritable = overwritable;
+	f->wr_idx = f->rd_idx = 0;
+	return true;
+}
+
+bool tu_fifo_clear(tu_fifo_t *f) {
+	f->wr_idx = f->rd_idx = 0;
+	return true;
+}
+
+uint16_t tu_fifo_count(tu_fifo_t *f) {
+	return f->wr_idx - f->rd_idx;
+}
+
+uint16_t tu_fifo_remaining(tu_fifo_t *f) {
+	return f->depth - tu_fifo_count(f);
+}
+
+uint16_t tu_fifo_read_n(tu_fifo_t *f, void *buffer, uint16_t n) {
+	uint16_t count = tu_fifo_count(f);
+	if (n > count)
+		n = count;
+	for (uint16_t i = 0; i < n; i++)
+		((uint8_t*) buffer)[i] = f->buffer[(f->rd_idx++) % f->depth];
+	return n;
+}
+
+uint16_t tu_fifo_write_n(tu_fifo_t *f, void const *data, uint16_t n) {
+	uint16_t remaining = tu_fifo_remaining(f);
+	if (n > remaining)
+		n = remaining;
+	for (uint16_t i = 0; i < n; i++)
+		f->buffer[(f->wr_idx++) % f->depth] = ((uint8_t const*) data)[i];
+	return n;
+}
+
+//--------------------------------------------------------------------+
+// Adafruit wrapper
+//--------------------------------------------------------------------+
+void Adafruit_USBD_Interface::setStringDescriptor(const char *str) {
+	(void) str;
+	_strid = TinyUSBDevice.allocString();
+}
+
+bool Adafruit_USBD_Device::addInterface(Adafruit_USBD_Interface &itf) {
+	if (itfCount >= MAX_ITF)
+		return false;
+	itfs[itfCount++] = &itf;
+	return true;
+}
+
+void Adafruit_USBD_Device::clearConfiguration() {
+	itfCount = itfNum = 0;
+	epIn = epOut = 1;
+}
+
+uint8_t Adafruit_USBD_Device::allocInterface(uint8_t count) {
+	uint8_t n = itfNum;
+	itfNum += count;
+	return n;
+}
+
+uint8_t Adafruit_USBD_Device::allocEndpoint(uint8_t in) {
+	return in ? (TUSB_DIR_IN_MASK | epIn++) : epOut++;
+}
+
+//--------------------------------------------------------------------+
+// device controller
+//--------------------------------------------------------------------+
+typedef struct {
+	bool open, claimed, busy;
+	uint8_t type;
+	uint8_t *buf;
+	uint16_t len, done, mps;
+	usbd_class_driver_t const *drv;
+} sim_edpt_t;
+
+static sim_edpt_t edpts[16][2];
+static usbd_class_driver_t const *openingDriver;
+
+static std::deque<std::vector<uint8_t>> hostOut;
+static size_t hostOutOff;
+static std::vector<uint8_t> hostIn;
+static std::deque<std::vector<uint8_t>> hostNotify; // interrupt IN transfers
+static std::vector<uint8_t> hostCtrl; // data stage of the last control request
+static int taskDepth;
+
+static sim_edpt_t* edpt(uint8_t ep_addr) {
+	return &edpts[ep_addr & 0x0F][tu_edpt_dir(ep_addr)];
+}
+
+static void wireTime(uint32_t bytes) {
+	sim::advance((uint64_t) (bytes + sim::model.usbPktOverhead) * 8 * sim::model.usbBitNs);
+}
+
+bool usbd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const *desc_ep) {
+	(void) rhport;
+	sim_edpt_t *ep = edpt(desc_ep->bEndpointAddress);
+	*ep = {};
+	ep->open = true;
+	ep->type = desc_ep->bmAttributes.xfer;
+	ep->mps = desc_ep->wMaxPacketSize;
+	ep->drv = openingDriver;
+	return true;
+}
+
+bool usbd_open_edpt_pair(uint8_t rhport, uint8_t const *p_desc, uint8_t ep_count, uint8_t xfer_type, uint8_t *ep_out,
+		uint8_t *ep_in) {
+	for (int i = 0; i < ep_count; i++) {
+		tusb_desc_endpoint_t const *desc_ep = (tusb_desc_endpoint_t const*) p_desc;
+		TU_ASSERT(TUSB_DESC_ENDPOINT == desc_ep->bDescriptorType && xfer_type == desc_ep->bmAttributes.xfer);
+		TU_ASSERT(usbd_edpt_open(rhport, desc_ep));
+
+		if (tu_edpt_dir(desc_ep->bEndpointAddress) == TUSB_DIR_IN) {
+			*ep_in = desc_ep->bEndpointAddress;
+		} else {
+			*ep_out = desc_ep->bEndpointAddress;
+		}
+		p_desc = tu_desc_next(p_desc);
+	}
+	return true;
+}
+
+bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr) {
+	(void) rhport;
+	sim_edpt_t *ep = edpt(ep_addr);
+	if (ep->busy || ep->claimed)
+		return false;
+	return ep->claimed = true;
+}
+
+bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr) {
+	(void) rhport;
+	sim_edpt_t *ep = edpt(ep_addr);
+	if (!ep->claimed || ep->busy)
+		return false;
+	ep->claimed = false;
+	return true;
+}
+
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes) {
+	(void) rhport;
+	sim_edpt_t *ep = edpt(ep_addr);
+	TU_ASSERT(ep->open && !ep->busy);
+	ep->claimed = false;
+	ep->busy = true;
+	ep->buf = buffer;
+	ep->len = total_bytes;
+	ep->done = 0;
+	return true;
+}
+
+bool usbd_edpt_busy(uint8_t rhport, uint8_t ep_addr) {
+	(void) rhport;
+	return edpt(ep_addr)->busy;
+}
+
+bool tud_control_xfer(uint8_t rhport, tusb_control_request_t const *request, void *buffer, uint16_t len) {
+	(void) rhport, (void) request;
+	hostCtrl.assign((uint8_t*) buffer, (uint8_t*) buffer + len);
+	return true;
+}
+
+bool tud_control_status(uint8_t rhport, tusb_control_request_t const *request) {
+	(void) rhport, (void) request;
+	return true;
+}
+
+bool tud_mounted(void) {
+	return TinyUSBDevice.mounted();
+}
+
+namespace sim {
+
+void usbEnumerate() {
+	uint8_t desc[512];
+	uint8_t count = 0;
+	sim::advance(sim::model.enumerateNs); // core 1 runs meanwhile
+	usbd_class_driver_t const *drv = usbd_app_driver_get_cb(&count);
+
+	if (drv->init)
+		drv->init();
+
+	for (uint8_t i = 0; i < TinyUSBDevice.interfaceCount(); i++) {
+		uint16_t len = TinyUSBDevice.interface(i)->getInterfaceDescriptor(0, desc, sizeof(desc));
+		openingDriver = drv;
+		for (uint16_t off = 0; off < len;) {
+			uint16_t n = drv->open(0, (tusb_desc_interface_t const*) &desc[off], len - off);
+			off += n ? n : tu_desc_len(&desc[off]);
+		}
+		openingDriver = NULL;
+	}
+	TinyUSBDevice.setMounted(true);
+}
+
+void usbHostSend(const uint8_t *buf, uint32_t len) {
+	hostOut.emplace_back(buf, buf + len);
+}
+
+uint32_t usbHostReceive(uint8_t *buf, uint32_t len) {
+	if (len > hostIn.size())
+		len = hostIn.size();
+	memcpy(buf, hostIn.data(), len);
+	hostIn.erase(hostIn.begin(), hostIn.begin() + len);
+	return len;
+}
+
+uint32_t usbHostPending() {
+	return hostIn.size();
+}
+
+uint32_t usbHostNotification(uint8_t *buf, uint32_t len) {
+	if (hostNotify.empty())
+		return 0;
+	std::vector<uint8_t> &xfer = hostNotify.front();
+	len = xfer.size() < len ? xfer.size() : len;
+	memcpy(buf, xfer.data(), len);
+	hostNotify.pop_front();
+	return len;
+}
+
+int32_t usbHostControl(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *buf,
+		uint16_t len) {
+	tusb_control_request_t request = { };
+	request.bmRequestType = bmRequestType;
+	request.bRequest = bRequest;
+	request.wValue = wValue;
+	request.wIndex = wIndex;
+	request.wLength = len;
+	uint8_t count = 0;
+	usbd_class_driver_t const *drv = usbd_app_driver_get_cb(&count);
+	hostCtrl.clear();
+	wireTime(sizeof(request));
+	if (!drv->control_xfer_cb || !drv->control_xfer_cb(0, CONTROL_STAGE_SETUP, &request))
+		return -1; // stalled
+	wireTime(hostCtrl.size());
+	drv->control_xfer_cb(0, CONTROL_STAGE_ACK, &request);
+	len = hostCtrl.size() < len ? hostCtrl.size() : len;
+	memcpy(buf, hostCtrl.data(), len);
+	return len;
+}
+
+static bool completeIn(uint8_t n) {
+	sim_edpt_t *ep = &edpts[n][TUSB_DIR_IN];
+	if (!ep->busy)
+		return false;
+
+	if (ep->type == TUSB_XFER_INTERRUPT)
+		hostNotify.emplace_back(ep->buf, ep->buf + ep->len);
+	for (uint16_t off = 0; off < ep->len; off += ep->mps) {
+		uint16_t pkt = ep->len - off < ep->mps ? ep->len - off : ep->mps;
+		wireTime(pkt);
+		if (ep->type != TUSB_XFER_INTERRUPT)
+			hostIn.insert(hostIn.end(), ep->buf + off, ep->buf + off + pkt);
+	}
+	ep->busy = false;
+	ep->drv->xfer_cb(0, TUSB_DIR_IN_MASK | n, XFER_RESULT_SUCCESS, ep->len);
+	return true;
+}
+
+static bool completeOut(uint8_t n) {
+	sim_edpt_t *ep = &edpts[n][TUSB_DIR_OUT];
+	if (!ep->busy || hostOut.empty())
+		return false;
+
+	bool shortPkt = false;
+	while (!shortPkt && ep->done < ep->len && !hostOut.empty()) {
+		std::vector<uint8_t> &xfer = hostOut.front();
+		size_t pkt = xfer.size() - hostOutOff < ep->mps ? xfer.size() - hostOutOff : ep->mps;
+		if (pkt > (size_t) (ep->len - ep->done))
+			pkt = ep->len - ep->done;
+		wireTime(pkt);
+		memcpy(ep->buf + ep->done, xfer.data() + hostOutOff, pkt);
+		ep->done += pkt;
+		hostOutOff += pkt;
+		shortPkt = pkt < ep->mps;
+		if (hostOutOff == xfer.size()) {
+			hostOut.pop_front();
+			hostOutOff = 0;
+		}
+	}
+	ep->busy = false;
+	ep->drv->xfer_cb(0, n, XFER_RESULT_SUCCESS, ep->done);
+	return true;
+}
+
+void usbTask() {
+	bool work = false;
+	taskDepth++;
+	for (uint8_t n = 1; n < 16; n++) {
+		work |= completeIn(n);
+		if (taskDepth == 1) // class driver callbacks are not re-entered for new data
+			work |= completeOut(n);
+	}
+	taskDepth--;
+
+	if (!work)
+		sim::advance(sim::model.usbIdleNs);
+}
+
+} // end namespace
@@ -21,9 +21,10 @@
  *
  */
 
-#include "Arduino.h" // required for millis()
+#include "Arduino.h"
 #include "ccid.h"
 #include "seccid.h"
+#include "trace.h"
 
 SECCID_USBD_CCID ccid0;
 
@@ -50,16 +51,12 @@ extern "C" void setup() {
 	TinyUSBDevice.setDeviceVersion(USB_DEV);
 
 	ccid0.set_apdu_callback(process);
-	ccid0.begin();
-
-	bool usbConnected = (*(uint32_t*) (0x50110000 + 0x50)) & (1 << 16);
-	while (usbConnected && !Serial && millis() < 1000) {
-	}
-
-	if(Serial) {
-		Serial.println("DLR/CK Exp.007 SECCID booted.\n");
-		Serial.flush();
-	}
+	ccid0.set_dispatch_callback(dispatch);
+	ccid0.set_abort_callback(abortLane);
+	setWaitCallback([] {
+		ccid0.execute(); // core 1: serve other lanes while an SE computes
+	});
+	ccid0.begin(); // enumerates right away, core 1 attaches the SEs meanwhile, nothing waits for the CDC console
 }
 
 void tud_ccid_rx_cb(uint8_t itf) {
@@ -69,9 +66,36 @@ void tud_ccid_rx_cb(uint8_t itf) {
 }
 
 extern "C" void loop() {
-	if (Serial && Serial.available()) {
-		String s = Serial.readString();
-		Serial.printf("> %s\n", s.c_str());
+	ccid0.run(); // send responses from core 1, time extensions
+	if (!Serial)
+		return;
+
+	static bool booted = false;
+	if (!booted) { // once a terminal opened the CDC port
+		Serial.println("DLR/CK Exp.007 SECCID booted.\n");
+		booted = true;
+	}
+	seccid::trace.drain(Serial, 4); // a few frames per pass, only as far as the CDC FIFO takes them
+
+	static String line; // echoed per line, readString() would block loop() for its timeout
+	while (Serial.available()) {
+		const char c = Serial.read();
+		if (c != '\r' && c != '\n') {
+			line += c;
+		} else if (line.length()) {
+			Serial.printf("> %s\n", line.c_str());
+			line = "";
+		}
 	}
+}
+
+// core 1: secure element transport, fed by the CCID layer through lock-free rings
+void setup1() {
+	seBegin();
+}
 
+void loop1() {
+	ccid0.execute();
+	if (ccid0.idle())
+		prefetch(); // random pool
 }
@@ -22,55 +22,526 @@
  */
 
 #include "seccid.h"
+#include "ccid.h"
 #include "gpi2c.h"
+#include "apducache.h"
+#include "stats.h"
+#include "trace.h"
 #include <Adafruit_NeoPixel.h>
 
 #undef PIN_NEOPIXEL // override for QtPy RP2040 NeoPixel
 #define PIN_NEOPIXEL   (12u)
 #define NEOPIXEL_POWER (11u)
 
+#ifndef SE_POWER_PIN
+#define SE_POWER_PIN (-1) // GPIO switching the SE supply for recovery, high: on, -1: not wired
+#endif
+#ifndef SE1_POWER_PIN
+#define SE1_POWER_PIN (-1) // same for the SE of slot 1
+#endif
+#define SE_WAKEUP_US (1000) // switched supply on to the first I2C access, the CIP tells WUT only later
+#ifndef SE_WIRING
+#define SE_WIRING { &Wire, 0x48, SE_POWER_PIN }, { &Wire1, 0x48, SE1_POWER_PIN } // bus, address, power pin per lane
+#endif
+#ifndef SE_POOL_SIZE
+#define SE_POOL_SIZE (1) // SEs pooled behind slot 0 at boot, 1: none (FFFF C5xx)
+#endif
+#define SE_POOL_FAILS (3) // failed commands in a row that drain a pool member
+#define SE_POOL_INS (8) // INS any pool member may execute (FFFF CBxx)
+#ifndef SE_CACHE_SIZE
+#define SE_CACHE_SIZE (4096) // bytes of the response cache (FFFF C8xx), 0: none
+#endif
+#define SE_CACHE_CMD (64) // longest command cached
+#define SE_CACHE_INS (8) // allowlist entries
+#define SE_CHANNELS (20) // logical channels, 4 in the first and 16 in the further interindustry class
+#ifndef SE_RANDOM_POOL
+#define SE_RANDOM_POOL (512) // bytes of random prefetched from the SE while idle (FFFF C9xx), power of two, 0: none
+#endif
+static_assert(!(SE_RANDOM_POOL & (SE_RANDOM_POOL - 1)), "SE_RANDOM_POOL must be a power of two");
+#ifndef SE_GET_RESPONSE
+#define SE_GET_RESPONSE (16) // 61xx parts fetched by the device per APDU, 0: 61xx / 6Cxx go to the host
+#endif
+
 Adafruit_NeoPixel pixel(1, PIN_NEOPIXEL);
+seccid::Trace seccid::trace; // drained to Serial by loop()
+seccid::Stats seccid::stats;
+static_assert(seccid::Stats::SIZE + 2 <= CCID_IFSD, "FFFF C4xx response exceeds the CCID message");
 
 const uint8_t detectAID[] = { 0xD2, 0x76, 0x00, 0x00, 0x93, 0xFE, 0x00, 0x42 };
 
-uint32_t callctr = 0;
-TwoWire *seBus = &Wire;
-uint8_t seAddr = 0x48;
-seccid::GPI2C *se1;
-uint32_t callSE(uint8_t *buf, uint32_t len);
+// session of an SE, kept across FFFF C000: re-attaching costs one exchange as long as the SE is healthy
+typedef enum : uint8_t {
+	SE_UNINIT, // nothing known: boot, bus or address changed (FFFF C2xx / C3xx)
+	SE_CIP, // soft reset and CIP done, S(IFS) failed
+	SE_ACTIVE, // in session, N(S) and learned timing valid
+	SE_SUSPENDED, // released (FFFF C001), may save power until the next block
+	SE_ERROR, // did not recover, APDUs still try the recovery ladder
+} se_state_t;
+
+// one secure element per CCID slot / lane: bus and address (FFFF C2xx / C3xx), statically allocated transport
+typedef struct {
+	TwoWire *bus;
+	uint8_t addr;
+	int8_t pwrPin;
+	seccid::GPI2C *se;
+	se_state_t state;
+	uint8_t busy, fails; // command executing, failed commands in a row
+	bool drained; // taken out of the pool until initialised again
+	bool held; // host's command chain, 61xx continuation or challenge open, no prefetch before its next command
+	uint32_t apdus;
+} se_slot_t;
+
+typedef struct {
+	TwoWire *bus;
+	uint8_t addr;
+	int8_t pwrPin;
+} se_wiring_t;
+
+const se_wiring_t seWiring[] = { SE_WIRING };
+static_assert(sizeof(seWiring) / sizeof(seWiring[0]) >= CFG_TUD_CCID_LANES, "SE_WIRING needs an entry per lane");
+
+seccid::GPI2C seT1[CFG_TUD_CCID_LANES];
+se_slot_t seSlots[CFG_TUD_CCID_LANES]; // wired by seBegin()
+
+// pool: slot 0 fronts SEs 0 .. poolSize - 1. Stateless commands go to any idle healthy member, all others
+// to the home member that holds the session. Members stay addressable through their own slot.
+uint8_t poolSize = SE_POOL_SIZE, poolHome = 0, poolNext = 0;
+uint8_t poolINS[SE_POOL_INS] = { 0x84 }, poolINSs = 1; // GET CHALLENGE, set by FFFF CB01
 
-void printHex(Stream &out, uint8_t *buf, uint32_t len) {
-	for (uint32_t i = 0; i < len; out.printf("%2.2X", buf[i++]))
-		;
+std::atomic<void (*)(void)> seWaitCb { NULL }; // set by core 0 in setup() while core 1 may attach already
+uint32_t callSE(se_slot_t &s, uint8_t *buf, uint32_t len, apdu_t &apdu, uint32_t lo = CCID_IFSD);
+
+void setWaitCallback(void (*cb)(void)) {
+	seWaitCb.store(cb, std::memory_order_release);
 }
 
-uint32_t process(uint8_t *buf, uint32_t len) {
-	const uint16_t CLAINS = ((buf[0] << 8) | buf[1]), P1P2 = ((buf[2] << 8) | buf[3]), LC =
-			!buf[4] && len > 5 ? (buf[5] << 8) | buf[6] : buf[4];
-	uint16_t SW1SW2 = 0x6D00;
+static void seWait() { // installed in each transport, looks the callback up when waiting
+	void (*cb)(void) = seWaitCb.load(std::memory_order_acquire);
+	if (cb)
+		cb();
+}
+
+void abortLane(uint8_t lane) {
+	if (lane < CFG_TUD_CCID_LANES)
+		seSlots[lane].se->cancel();
+}
 
-	uint32_t x = 0, y = 0;
+// ICC presence per CCID slot, slot 0 of a pool is present while any member is. reset: lane re-initialised
+static void updateSlots(int8_t reset = -1) {
+	for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++) {
+		bool present = !seSlots[slot].drained;
+		for (uint8_t i = 1; !slot && i < poolSize && i < CFG_TUD_CCID_LANES; i++)
+			present |= !seSlots[i].drained;
+		tud_ccid_n_slot_changed(0, slot, present, reset == slot || (!slot && poolSize > 1 && reset == poolHome));
+	}
+}
+
+// another lane addresses the SE at bus/addr: two T=1' sessions would break each other's sequence numbers
+static bool seInUse(uint8_t lane, const TwoWire *bus, uint8_t addr) {
+	for (uint8_t i = 0; i < CFG_TUD_CCID_LANES; i++)
+		if (i != lane && seSlots[i].bus == bus && seSlots[i].addr == addr)
+			return true;
+	return false;
+}
+
+// entry of an APDU list (FFFF C6xx / C7xx): 80 L APDU, optionally followed by 81 04 SW MASK
+typedef struct {
+	uint32_t off, len; // APDU
+	uint16_t expect, mask; // SW & mask must equal expect, 0 / 0 without 81
+} list_entry_t;
+
+// size of the entry at p, 0: incomplete, more bytes follow unless last, -1: malformed
+static int32_t listEntry(const uint8_t *p, uint32_t avail, bool last, list_entry_t &e) {
+	const int32_t more = last ? -1 : 0;
+	if (avail && p[0] != 0x80)
+		return -1;
+	if (avail < 2)
+		return more;
+	const uint8_t h = p[1] < 0x80 ? 1 : p[1] == 0x81 ? 2 : p[1] == 0x82 ? 3 : 0;
+	if (!h)
+		return -1;
+	if (avail < 1u + h)
+		return more;
+	e.off = 1 + h;
+	e.len = h == 1 ? p[1] : h == 2 ? p[2] : (p[2] << 8) | p[3];
+	e.expect = e.mask = 0;
+	uint32_t end = e.off + e.len;
+	if (e.len < 4 || end + 6 > CCID_IFSD)
+		return -1;
+	if (avail < end || (avail == end && !last)) // 81 may follow
+		return more;
+	if (avail > end && p[end] == 0x81) {
+		if (avail < end + 6)
+			return more;
+		if (p[end + 1] != 4)
+			return -1;
+		e.expect = (p[end + 2] << 8) | p[end + 3];
+		e.mask = (p[end + 4] << 8) | p[end + 5];
+		end += 6;
+	}
+	return end;
+}
+
+// script session (FFFF C7xx): an APDU list streamed in chunks, entries execute as soon as they are complete
+struct {
+	int8_t lane; // owner, -1: none
+	bool stop, stopped; // stop at the first unexpected SW, stopped
+	uint32_t executed, failed, held; // APDUs executed, index of the first failure, bytes of a partial entry
+	uint16_t failSW;
+} script = { -1 };
+uint8_t scriptBuf[CCID_IFSD]; // partial entry carried over to the next chunk, APDU executing
+
+static void scriptFail(uint16_t sw, bool stop) {
+	if (script.failed == 0xFFFFFFFF) {
+		script.failed = script.executed;
+		script.failSW = sw;
+	}
+	script.stopped |= stop;
+}
 
-	Serial.printf("APDU: %4.4X %4.4X %4.4X %4.4X: ", len, CLAINS, P1P2, LC);
-	printHex(Serial, buf, len);
-	Serial.println();
+// APDU of the entry at p executed in scriptBuf, slot errors (kept in err) stop the script as SW 6F00
+static void scriptRun(se_slot_t &s, const uint8_t *p, const list_entry_t &e, int32_t &err) {
+	apdu_t c;
+	memmove(scriptBuf, &p[e.off], e.len);
+	const int32_t m = decodeAPDU(scriptBuf, e.len, c) ? (int32_t) callSE(s, scriptBuf, e.len, c) : -1;
+	const uint16_t sw = m >= 2 ? (scriptBuf[m - 2] << 8) | scriptBuf[m - 1] : m == -1 ? 0x6A80 : 0x6F00;
+	if (m < -1)
+		err = m;
+	if (m < 2 || (sw & e.mask) != e.expect)
+		scriptFail(sw, script.stop || m < 2);
+	script.executed++;
+}
 
-	if (!callctr++) {
-		pinMode(NEOPIXEL_POWER, OUTPUT); // NeoPixel Power
-		digitalWrite(NEOPIXEL_POWER, 1);
-		pixel.begin();
-		pixel.fill(pixel.Color(31, 0, 0), 0, 1);
-		pixel.show(); // indicate presence of power
-		TwoWire &bus = *seBus;
-		bus.begin();
-		bus.setClock(1000000);
-		bus.beginTransmission(seAddr);
-		if (!bus.endTransmission()) {
-			// init secure element
+// n bytes of the stream, last: no more follow. An entry split across chunks is completed in scriptBuf.
+static void scriptChunk(se_slot_t &s, const uint8_t *d, uint32_t n, bool last, int32_t &err) {
+	for (uint32_t pos = 0; !script.stopped && (pos < n || (last && script.held));) {
+		list_entry_t e;
+		if (script.held) {
+			const uint32_t held = script.held, take = n - pos < CCID_IFSD - held ? n - pos : CCID_IFSD - held;
+			memcpy(&scriptBuf[held], &d[pos], take);
+			const int32_t size = listEntry(scriptBuf, held + take, last && pos + take == n, e);
+			if (size <= 0) {
+				if (size < 0)
+					scriptFail(0x6A80, true);
+				script.held += take;
+				pos += take;
+				continue;
+			}
+			pos += size - held;
+			script.held = 0;
+			scriptRun(s, scriptBuf, e, err);
+		} else {
+			const int32_t size = listEntry(&d[pos], n - pos, last, e);
+			if (size <= 0) {
+				if (size < 0)
+					scriptFail(0x6A80, true);
+				memcpy(scriptBuf, &d[pos], n - pos);
+				script.held = n - pos;
+				pos = n;
+				continue;
+			}
+			scriptRun(s, &d[pos], e, err);
+			pos += size;
 		}
 	}
+}
+
+// response cache in front of the SEs, off until the host sets the INS allowlist (FFFF C8xx). The selection
+// of each logical channel is tracked as a hash over the AID and the SELECTs since, 0: unknown. A SELECT by
+// AID is answered from the cache only when that applet is selected already.
+seccid::APDUCache<SE_CACHE_SIZE> cache;
+uint8_t cacheINS[SE_CACHE_INS], cacheINSs = 0;
+uint32_t selCtx[CFG_TUD_CCID_LANES][SE_CHANNELS], cachePower = 0;
+const uint8_t writeINS[] = { 0x04, 0x0E, 0x24, 0x2C, 0x44, 0x46, 0x70, 0xD0, 0xD2, 0xD6, 0xD8, 0xDA, 0xDB, 0xDC,
+		0xE0, 0xE2, 0xE4, 0xE6, 0xE8, 0xF0 }; // flush the lane, MANAGE CHANNEL / DELETE / INSTALL its selections too.
+// Proprietary classes flush on every INS outside the allowlist.
+
+// random pool, core 1 only: filled by prefetch() while no XfrBlock is pending, with the command set by the
+// first FFFF C900 (default GET CHALLENGE, 32 bytes). Off until then: a prefetch replaces the SE's challenge.
+uint8_t randPool[SE_RANDOM_POOL ? SE_RANDOM_POOL : 1], randCmd[16] = { 0x00, 0x84, 0x00, 0x00, 0x20 };
+uint8_t randCmdLen = 5;
+uint16_t randChunk = 32; // bytes per fetch
+uint32_t randHead = 0, randTail = 0; // free running
+int8_t randLane = -1; // SE prefetching, -1: off
+
+static uint32_t randTake(uint8_t *p, uint32_t n) {
+	uint32_t k = 0;
+	for (; k < n && randTail != randHead; k++)
+		p[k] = randPool[randTail++ & (SE_RANDOM_POOL - 1)];
+	return k;
+}
+
+static void randPut(const uint8_t *p, uint32_t n) {
+	for (; n && randHead - randTail < SE_RANDOM_POOL; n--)
+		randPool[randHead++ & (SE_RANDOM_POOL - 1)] = *p++;
+}
+
+typedef struct {
+	uint8_t cmd[SE_CACHE_CMD], chan, ins;
+	uint16_t len;
+	uint32_t key, next; // cached under, selection after success
+} cache_op_t;
+
+static uint32_t ctxHash(uint32_t h, const uint8_t *p, uint32_t len) { // FNV-1a
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h | 1;
+}
+
+static void cacheReset(int8_t lane = -1) {
+	cache.flush(lane);
+	if (lane < 0)
+		memset(selCtx, 0, sizeof(selCtx));
+	else
+		memset(selCtx[lane], 0, sizeof(selCtx[lane]));
+}
+
+// true: answered from the cache, the response replaces the command and its length is returned in lo
+static bool cacheFind(uint8_t lane, uint8_t *buf, uint32_t len, const apdu_t &apdu, uint32_t &lo, cache_op_t &op) {
+	uint32_t power = 0; // the host's card session ended
+	for (uint8_t slot = 0; slot < CFG_TUD_CCID_SLOTS; slot++)
+		power = (power << 8) | tud_ccid_n_slot_power(0, slot);
+	if (power != cachePower) {
+		cachePower = power;
+		cacheReset();
+	}
 
-	if (CLAINS == 0x00A4 && P1P2 == 0x0400 && len > 5 && buf[4] == sizeof(detectAID) && memcmp(detectAID, &buf[4], sizeof(detectAID))) { // SELECT check for detection
+	const uint8_t cla = buf[0], ins = op.ins = buf[1];
+	const bool plain = !(cla & 0x10) && !(cla & ((cla & 0x40) ? 0x20 : 0x0C)); // no chaining, no secure messaging
+	const uint32_t cur = selCtx[lane][op.chan = (cla & 0x40) ? 4 + (cla & 0x0F) : cla & 0x03];
+	op.key = 0;
+	op.next = cur;
+	if (memchr(writeINS, ins, sizeof(writeINS)) || ((cla & 0x80) && !memchr(cacheINS, ins, cacheINSs))) {
+		cache.flush(lane); // proprietary: any INS not known to read, e.g. SE05x WriteSecureObject / DeleteSecureObject
+		if (ins == 0x70 || ins == 0xE4 || ins == 0xE6)
+			op.next = 0;
+		return false;
+	}
+	if (ins == 0xA4) {
+		if (plain && (apdu.p1p2 & 0xFF03) == 0x0400 && apdu.nc)
+			op.key = op.next = ctxHash(2166136261u, apdu.data, apdu.nc);
+		else
+			op.next = plain && cur ? ctxHash(cur, buf, len) : 0;
+	} else {
+		op.key = cur;
+	}
+	if (!op.key || !plain || len > SE_CACHE_CMD || !memchr(cacheINS, ins, cacheINSs)) {
+		op.key = 0;
+		return false;
+	}
+
+	memcpy(op.cmd, buf, op.len = len);
+	uint16_t n;
+	const uint8_t *rsp = op.key == cur ? cache.find(lane, op.chan, op.key, buf, len, n) : NULL;
+	if (!rsp)
+		return false;
+	if (n > lo) { // cached, only longer than this command may take: the SE answers, no second record
+		op.key = 0;
+		return false;
+	}
+	memcpy(buf, rsp, lo = n);
+	return true;
+}
+
+static void cacheStore(uint8_t lane, const uint8_t *rsp, int32_t n, cache_op_t &op) {
+	if (n < 2) { // the SE may have been reset
+		cacheReset(lane);
+		return;
+	}
+	const bool ok = rsp[n - 2] == 0x90 && !rsp[n - 1];
+	if (ok || op.ins == 0xA4 || op.next != selCtx[lane][op.chan]) // a failed SELECT leaves no selection known
+		selCtx[lane][op.chan] = ok ? op.next : 0;
+	if (ok && op.key)
+		cache.store(lane, op.chan, op.key, op.cmd, op.len, rsp, n);
+}
+
+static bool stateless(uint8_t *buf, uint32_t len) {
+	apdu_t apdu;
+	if (!decodeAPDU(buf, len, apdu) || ((apdu.clains >> 8) & 0x1F)) // chained, secure messaging or logical channel
+		return false;
+	return memchr(poolINS, apdu.clains & 0xFF, poolINSs) != NULL;
+}
+
+// a job started from the wait of other lanes delays their responses until it ends: its execution time, as learned
+// by any SE, must fit into what each waiting command still takes. Unknown ones wait for the CCID layer's next turn.
+static bool fits(const uint8_t *buf, uint32_t len) {
+	uint32_t t = 0;
+	for (uint8_t i = 0; len > 1 && i < CFG_TUD_CCID_LANES; i++) {
+		const uint32_t e = seSlots[i].se->expectedUs(buf[1]);
+		t = e > t ? e : t;
+	}
+	for (uint8_t i = 0; i < CFG_TUD_CCID_LANES; i++)
+		if (seSlots[i].busy && (!t || t > seSlots[i].se->remainingUs()))
+			return false;
+	return true;
+}
+
+static int8_t member(uint8_t slot, uint8_t *buf, uint32_t len, uint32_t busyLanes) {
+	if (slot || poolSize < 2) // own SE, or a pool member addressed directly
+		return slot;
+
+	bool healthy = false;
+	for (uint8_t i = 0; i < poolSize && !healthy; i++)
+		healthy = !seSlots[i].drained;
+	if (healthy && seSlots[poolHome].drained) { // session moves on, the SE reports a fresh state
+		for (poolHome = 0; seSlots[poolHome].drained; poolHome++)
+			;
+	}
+	if (!healthy || !stateless(buf, len))
+		return poolHome;
+
+	for (uint8_t i = 0; i < poolSize; i++) { // round robin over idle members
+		const uint8_t m = (poolNext + i) % poolSize;
+		if (!(busyLanes & (1 << m)) && !seSlots[m].drained) {
+			poolNext = m + 1;
+			return m;
+		}
+	}
+	return -1;
+}
+
+int8_t dispatch(uint8_t slot, uint8_t *buf, uint32_t len, uint32_t busyLanes) {
+	const int8_t lane = member(slot, buf, len, busyLanes);
+	return lane < 0 || fits(buf, len) ? lane : -1;
+}
+
+bool decodeAPDU(uint8_t *buf, uint32_t len, apdu_t &apdu) {
+	if (len < 4)
+		return false;
+
+	apdu.clains = (buf[0] << 8) | buf[1];
+	apdu.p1p2 = (buf[2] << 8) | buf[3];
+	apdu.nc = apdu.ne = 0;
+	apdu.data = NULL;
+	apdu.ext = false;
+
+	if (len == 4) // case 1
+		return true;
+
+	if (len == 5) { // case 2S
+		apdu.ne = buf[4] ? buf[4] : 256;
+		return true;
+	}
+
+	if (buf[4]) { // case 3S, 4S
+		apdu.nc = buf[4];
+		apdu.data = &buf[5];
+		if (len == 6 + apdu.nc)
+			apdu.ne = buf[5 + apdu.nc] ? buf[5 + apdu.nc] : 256;
+		return len == 5 + apdu.nc || len == 6 + apdu.nc;
+	}
+
+	apdu.ext = true;
+	if (len == 7) { // case 2E
+		apdu.ne = (buf[5] << 8) | buf[6];
+		apdu.ne = apdu.ne ? apdu.ne : 65536;
+		return true;
+	}
+
+	apdu.nc = len > 7 ? (buf[5] << 8) | buf[6] : 0; // case 3E, 4E
+	apdu.data = &buf[7];
+	if (len == 9 + apdu.nc) {
+		apdu.ne = (buf[7 + apdu.nc] << 8) | buf[8 + apdu.nc];
+		apdu.ne = apdu.ne ? apdu.ne : 65536;
+	}
+	return apdu.nc && (len == 7 + apdu.nc || len == 9 + apdu.nc);
+}
+
+// bring an SE into SE_ACTIVE with the least its state allows: S(CIP) in session, S(IFS) after a reset, otherwise a
+// fresh transport and soft reset. cold: the SE was reset, its state is lost.
+static bool seAttach(uint8_t lane, bool &cold) {
+	se_slot_t &s = seSlots[lane];
+	cold = false;
+	if ((s.state == SE_ACTIVE || s.state == SE_SUSPENDED) && s.se->probe()) {
+		s.state = SE_ACTIVE;
+		return true;
+	}
+
+	cold = true;
+	if (s.state != SE_CIP) {
+		s.bus->begin();
+		s.bus->setClock(1000000);
+		s.bus->beginTransmission(s.addr);
+		if (s.bus->endTransmission()) { // nobody at the address
+			s.state = SE_UNINIT;
+			seccid::trace.event(seccid::TRACE_SE_FAIL, lane, s.state);
+			return false;
+		}
+		*s.se = seccid::GPI2C(s.bus, s.addr); // learned timing belongs to the SE replaced
+		if (s.bus == &Wire)
+			s.se->setRecoveryPins(PIN_WIRE0_SDA, PIN_WIRE0_SCL, s.pwrPin);
+		else
+			s.se->setRecoveryPins(PIN_WIRE1_SDA, PIN_WIRE1_SCL, s.pwrPin);
+		s.se->setWaitCallback(seWait); // other lanes execute while this SE computes
+		s.state = s.se->reset() ? SE_CIP : SE_ERROR;
+	}
+	if (s.state == SE_CIP && s.se->negotiate())
+		s.state = SE_ACTIVE;
+	if (SE_CACHE_SIZE)
+		cacheReset(lane);
+	if (s.state != SE_ACTIVE) {
+		seccid::trace.event(seccid::TRACE_SE_FAIL, lane, s.state);
+		return false;
+	}
+
+	const seccid::cip_t &cip = s.se->getCIP();
+	const uint16_t cipTrace[] = { cip.pver, cip.ifsc, cip.mcf, cip.mpot, cip.bwt, cip.wut }; // little endian
+	seccid::trace.event(seccid::TRACE_SE_CIP, lane, cip.hbLen, (const uint8_t*) cipTrace, sizeof(cipTrace));
+	if (lane < CFG_TUD_CCID_SLOTS) {
+		tud_ccid_n_slot_clock(0, lane, s.se->getClock());
+		tud_ccid_n_slot_atr(0, lane, cip.hb, cip.hbLen);
+	}
+	return true;
+}
+
+void seBegin() {
+	pinMode(NEOPIXEL_POWER, OUTPUT); // NeoPixel Power
+	digitalWrite(NEOPIXEL_POWER, 1);
+	pixel.begin();
+	pixel.fill(pixel.Color(31, 0, 0), 0, 1);
+	pixel.show(); // indicate presence of power
+	bool switched = false;
+	for (uint8_t lane = 0; lane < CFG_TUD_CCID_LANES; lane++) {
+		se_slot_t &s = seSlots[lane];
+		s.bus = seWiring[lane].bus;
+		s.addr = seWiring[lane].addr;
+		s.pwrPin = seWiring[lane].pwrPin;
+		s.se = &seT1[lane];
+		if (s.pwrPin >= 0) { // switched supplies are off until driven
+			pinMode(s.pwrPin, OUTPUT);
+			digitalWrite(s.pwrPin, HIGH);
+			switched = true;
+		}
+	}
+	if (switched)
+		delayMicroseconds(SE_WAKEUP_US); // once for all, before the address probes
+	for (uint8_t lane = 0; lane < CFG_TUD_CCID_LANES; lane++) { // while the host enumerates, no card change to signal
+		se_slot_t &s = seSlots[lane];
+		bool cold;
+		s.drained = !seAttach(lane, cold); // absent until FFFF C000 finds it
+	}
+	updateSlots(); // the first NotifySlotChange and GetSlotStatus report the SEs actually fitted
+}
+
+uint32_t process(uint8_t lane, uint8_t *buf, uint32_t len) {
+	se_slot_t &s = seSlots[lane];
+	apdu_t apdu;
+	const bool valid = decodeAPDU(buf, len, apdu);
+	const uint16_t CLAINS = apdu.clains, P1P2 = apdu.p1p2;
+	uint16_t SW1SW2 = 0x6D00;
+
+	uint32_t y = 0;
+
+	if (!valid) {
+		buf[y++] = 0x67;
+		buf[y++] = 0x00;
+		return y;
+	}
+
+	seccid::trace.event(seccid::TRACE_APDU, lane, apdu.nc, buf, len);
+	s.held = false; // the host's next command, whatever it held the lane for is over
+
+	if (CLAINS == 0x00A4 && P1P2 == 0x0400 && apdu.nc == sizeof(detectAID) && !memcmp(detectAID, apdu.data, sizeof(detectAID))) { // SELECT check for detection
 		buf[y++] = 0x61;
 		buf[y++] = 0x0A;
 		buf[y++] = 0x4F;
@@ -87,52 +558,37 @@ uint32_t process(uint8_t *buf, uint32_t len) {
 		SW1SW2 = 0x9000;
 	} else if (CLAINS == 0xFFFF) { // reserved class/instruction pair
 		switch (P1P2 & 0xFF00) { // channel commands
-		case 0xC000: { // get ping and current setting
+		case 0xC000: { // get ping and current setting, attach the SE. P2 01: release it (S(RELEASE)) until the next APDU
+			if ((P1P2 & 0xFF) == 1) {
+				if (s.state == SE_ACTIVE && s.se->release())
+					s.state = SE_SUSPENDED;
+				SW1SW2 = s.state == SE_SUSPENDED ? 0x9000 : 0x6985; // released already: nothing to do
+				break;
+			}
 			pixel.fill(pixel.Color(0, 255, 0), 0, 1);
 			pixel.show();
-			if (!seBus) {
+			if (!s.bus) {
 				buf[y++] = 0xFF;
-			} else if (seBus == &Wire) {
+			} else if (s.bus == &Wire) {
 				buf[y++] = 0;
-			} else if (seBus == &Wire1) {
+			} else if (s.bus == &Wire1) {
 				buf[y++] = 1;
 			} else {
 				buf[y++] = 0xFE;
 			}
 
-			buf[y++] = seAddr;
-
-			TwoWire &bus = *seBus;
-			bus.begin();
-			bus.setClock(1000000);
-			bus.beginTransmission(seAddr);
-			if (!bus.endTransmission()) {
-				// init secure element
-				uint8_t apdu[261]; // 5 + 255 + 1
-				uint32_t le = sizeof(apdu), n = 0;
-
-				if (se1) {
-					se1->close();
-				}
-				se1 = new seccid::GPI2C(&bus);
-				se1->begin();
-
-
-				n = se1->I2CTX(0xCF, apdu, 0, le); // soft reset
-				Serial.printf("SE: %4.4X: ", n);
-				printHex(Serial, apdu, n);
-				Serial.println();
-
-				// XXX: some Arduino stacks support only 32 byte I2C buffers
-				//apdu[0] = 0x20; // 32 byte IFS
-				apdu[0] = 0x80; // 128 byte IFS
-				n = se1->I2CTX(0xC1, apdu, 1, 1);
-				Serial.printf("SE: %4.4X\n", n);
+			buf[y++] = s.addr;
 
+			bool cold;
+			if (seAttach(lane, cold)) {
+				s.fails = 0;
+				s.drained = false;
 				SW1SW2 = 0x9000;
 			} else {
-				SW1SW2 = 0x6A82;
+				s.drained = true;
+				SW1SW2 = s.state == SE_UNINIT ? 0x6A82 : 0x6F00;
 			}
+			updateSlots(cold ? lane : -1); // a warm attach leaves the host's card session alone
 			break;
 		}
 		case 0xC100: { // scan I2C busses
@@ -149,29 +605,262 @@ uint32_t process(uint8_t *buf, uint32_t len) {
 			SW1SW2 = !y ? 0x6A82 : 0x9000;
 			break;
 		}
-		case 0xC200: { // set I2C bus, maybe extend to GP-SPI
-			seBus = !(P1P2 & 0x00FF) ? &Wire : &Wire1;
+		case 0xC200: { // set I2C bus of the slot, maybe extend to GP-SPI. 6985: another slot addresses that SE
+			TwoWire *bus = !(P1P2 & 0x00FF) ? &Wire : &Wire1;
+			if (bus != s.bus && seInUse(lane, bus, s.addr)) {
+				SW1SW2 = 0x6985;
+				break;
+			}
+			if (bus != s.bus)
+				s.state = SE_UNINIT;
+			s.bus = bus;
 			SW1SW2 = 0x9000;
 			break;
 		}
-		case 0xC300: { // set device address
-			TwoWire &bus = *seBus;
+		case 0xC300: { // set device address of the slot, 6985 as for C2xx
+			if ((P1P2 & 0x00FF) != s.addr && seInUse(lane, s.bus, P1P2 & 0x00FF)) {
+				SW1SW2 = 0x6985;
+				break;
+			}
+			TwoWire &bus = *s.bus;
 			bus.begin();
 			bus.setClock(1000000);
 			bus.beginTransmission((P1P2 & 0x00FF));
 			if (!bus.endTransmission()) {
-				seAddr = (P1P2 & 0x00FF);
+				if (s.addr != (P1P2 & 0x00FF))
+					s.state = SE_UNINIT;
+				s.addr = (P1P2 & 0x00FF);
 				SW1SW2 = 0x9000;
 			} else {
 				SW1SW2 = 0x6A82;
 			}
 			break;
 		}
+		case 0xC400: { // stage latency and transport counters, P2: 00 read, 01 reset. Counters, then per stage the
+			// maximum and STAT_BUCKETS log2 histogram buckets in us, see stats.h
+			if ((P1P2 & 0xFF) > 1) {
+				SW1SW2 = 0x6A86;
+				break;
+			}
+			if (P1P2 & 0xFF)
+				seccid::stats.reset();
+			else
+				y = seccid::stats.write(buf);
+			SW1SW2 = 0x9000;
+			break;
+		}
+		case 0xC500: { // SE pool behind slot 0: P2 members (1: off, 0: query only), state of each member
+			if ((P1P2 & 0x00FF) > CFG_TUD_CCID_LANES) {
+				SW1SW2 = 0x6A86;
+				break;
+			}
+			if (P1P2 & 0x00FF) {
+				poolSize = P1P2 & 0x00FF;
+				poolHome = poolNext = 0;
+				updateSlots();
+			}
+			buf[y++] = poolSize;
+			buf[y++] = poolHome;
+			for (uint8_t i = 0; i < poolSize; i++) { // state (FF: no SE, 80: drained, 01: busy), failures in a row, APDUs
+				const se_slot_t &m = seSlots[i];
+				buf[y++] = m.state == SE_UNINIT ? 0xFF : m.drained ? 0x80 : m.busy;
+				buf[y++] = m.fails;
+				buf[y++] = m.apdus >> 24;
+				buf[y++] = m.apdus >> 16;
+				buf[y++] = m.apdus >> 8;
+				buf[y++] = m.apdus;
+			}
+			SW1SW2 = 0x9000;
+			break;
+		}
+		case 0xCB00: { // INS of the commands any pool member may execute, P2: 00 query, 01 set from the data (empty:
+			// all go to the home member). Only commands independent of SELECT, MSE, VERIFY et al. belong here.
+			const uint8_t op = P1P2 & 0xFF;
+			if (op > 1 || apdu.nc > SE_POOL_INS) {
+				SW1SW2 = apdu.nc > SE_POOL_INS ? 0x6A80 : 0x6A86;
+				break;
+			}
+			if (op)
+				memcpy(poolINS, apdu.data, poolINSs = apdu.nc);
+			memcpy(&buf[y], poolINS, poolINSs);
+			y += poolINSs;
+			SW1SW2 = 0x9000;
+			break;
+		}
+		case 0xC600: { // batch: APDUs (80 L APDU), each optionally followed by the SW expected and its mask
+			// (81 04 SW MASK), executed back to back. P2 bit 0: stop at an unexpected SW. Responses as 80 82 LLLL,
+			// then 9000, 6400 stopped, 6A80 malformed, 6A84 response does not fit, 6F00 no SW.
+			// The list is moved to the end of buf, responses grow from the start into the entries executed.
+			const uint32_t total = apdu.nc;
+			uint8_t *list = &buf[CCID_IFSD - total];
+			memmove(list, apdu.data, total);
+			SW1SW2 = total ? 0x9000 : 0x6700;
+			for (uint32_t r = 0; r < total && SW1SW2 == 0x9000;) {
+				list_entry_t e;
+				const int32_t size = listEntry(&list[r], total - r, true, e);
+				if (size < 0) {
+					SW1SW2 = 0x6A80;
+					break;
+				}
+				const uint8_t *cmd = &list[r + e.off];
+				const uint32_t n = e.len;
+				r += size;
+
+				uint8_t *rsp = &buf[y + 4];
+				// room for the response, then the header of the next one stays clear of the next entry
+				const int32_t room = r < total ? &list[r] - rsp - 4 : &buf[CCID_IFSD - 2] - rsp;
+				apdu_t c;
+				memmove(rsp, cmd, n);
+				if (!decodeAPDU(rsp, n, c)) {
+					SW1SW2 = 0x6A80;
+					break;
+				}
+				if ((int32_t) (c.ext ? 2 : c.ne + 2) > room) {
+					SW1SW2 = 0x6A84;
+					break;
+				}
+				const int32_t m = callSE(s, rsp, n, c, room);
+				if (m < 0) // slot error as for a single APDU
+					return m;
+				if (m < 2) {
+					SW1SW2 = 0x6F00;
+					break;
+				}
+				buf[y++] = 0x80;
+				buf[y++] = 0x82;
+				buf[y++] = m >> 8;
+				buf[y++] = m & 0xFF;
+				y += m;
+				if ((P1P2 & 0x01) && (((rsp[m - 2] << 8) | rsp[m - 1]) & e.mask) != e.expect)
+					SW1SW2 = 0x6400;
+			}
+			break;
+		}
+		case 0xC700: { // script session, P2: 00 open (data: 01 stop at an unexpected SW), 01 chunk of the APDU
+			// list (as FFFF C6xx), 02 close. Chunks return the APDUs executed so far, 6400 once stopped. Close
+			// returns executed, index of the first failure (FFFFFFFF: none) and its SW.
+			const uint8_t op = P1P2 & 0xFF;
+			if (op > 2 || (script.lane >= 0 && script.lane != lane) || (op && script.lane != lane)) {
+				SW1SW2 = op > 2 ? 0x6A86 : 0x6985;
+				break;
+			}
+			int32_t err = 0;
+			if (!op) {
+				script = { (int8_t) lane, apdu.nc && (apdu.data[0] & 0x01), false, 0, 0xFFFFFFFF, 0, 0 };
+			} else if (!script.stopped) {
+				scriptChunk(s, apdu.nc ? apdu.data : buf, apdu.nc, op == 2, err);
+			}
+			if (err) // slot error, the script stopped: following chunks are acknowledged with 6400
+				return err;
+			buf[y++] = script.executed >> 24;
+			buf[y++] = script.executed >> 16;
+			buf[y++] = script.executed >> 8;
+			buf[y++] = script.executed;
+			if (op == 2) {
+				buf[y++] = script.failed >> 24;
+				buf[y++] = script.failed >> 16;
+				buf[y++] = script.failed >> 8;
+				buf[y++] = script.failed;
+				buf[y++] = script.failSW >> 8;
+				buf[y++] = script.failSW & 0xFF;
+				script.lane = -1;
+			}
+			SW1SW2 = script.stopped || (op == 2 && script.failed != 0xFFFFFFFF) ? 0x6400 : 0x9000;
+			break;
+		}
+		case 0xC900: { // random, P2 00: Le bytes (default 32) from the pool, from the SE when drained, and prefetch
+			// on this SE from now on. Data: command fetching random (default GET CHALLENGE, 32 bytes). 01: stop.
+			if (!SE_RANDOM_POOL || (P1P2 & 0xFF) > 1) {
+				SW1SW2 = 0x6A86;
+				break;
+			}
+			if (P1P2 & 0xFF) {
+				randLane = -1;
+				randHead = randTail = 0;
+				SW1SW2 = 0x9000;
+				break;
+			}
+			apdu_t t;
+			if (apdu.nc && (apdu.nc > sizeof(randCmd) || !decodeAPDU(apdu.data, apdu.nc, t) || !t.ne || t.ne > 256)) {
+				SW1SW2 = 0x6A80;
+				break;
+			}
+			if (apdu.nc) {
+				memcpy(randCmd, apdu.data, randCmdLen = apdu.nc);
+				randChunk = t.ne;
+				randHead = randTail = 0;
+			}
+			randLane = lane;
+
+			const uint32_t ne = !apdu.ne ? 32 : apdu.ne < CCID_IFSD / 2 ? apdu.ne : CCID_IFSD / 2;
+			SW1SW2 = 0x9000;
+			for (y = randTake(buf, ne); y < ne;) { // rest of the last response refills the pool
+				memcpy(&buf[y], randCmd, randCmdLen);
+				decodeAPDU(&buf[y], randCmdLen, t);
+				const int32_t n = callSE(s, &buf[y], randCmdLen, t, CCID_IFSD - 2 - y);
+				if (n < 0)
+					return n;
+				const bool ok = n >= 2 && buf[y + n - 2] == 0x90 && !buf[y + n - 1];
+				if (!ok || n == 2) { // a bare 9000 has no random, fetching again would never end
+					SW1SW2 = ok || n < 2 ? 0x6F00 : (buf[y + n - 2] << 8) | buf[y + n - 1];
+					y = 0;
+					break;
+				}
+				const uint32_t k = n - 2 < (int32_t) (ne - y) ? n - 2 : ne - y;
+				randPut(&buf[y + k], n - 2 - k);
+				y += k;
+				s.held = false; // fetched for the pool, not a challenge of the host
+			}
+			break;
+		}
+		case 0xC800: { // response cache, P2: 00 query, 01 INS allowlist from the data (empty: off), 02 flush.
+			// Returns hits, misses, bytes used and the allowlist.
+			const uint8_t op = P1P2 & 0xFF;
+			if (!SE_CACHE_SIZE || op > 2 || apdu.nc > SE_CACHE_INS) {
+				SW1SW2 = apdu.nc > SE_CACHE_INS ? 0x6A80 : 0x6A86;
+				break;
+			}
+			if (op == 1)
+				memcpy(cacheINS, apdu.data, cacheINSs = apdu.nc);
+			if (op)
+				cacheReset();
+			const uint32_t stats[] = { cache.hits, cache.misses };
+			for (uint32_t v : stats) {
+				buf[y++] = v >> 24;
+				buf[y++] = v >> 16;
+				buf[y++] = v >> 8;
+				buf[y++] = v;
+			}
+			buf[y++] = cache.fill() >> 8;
+			buf[y++] = cache.fill() & 0xFF;
+			memcpy(&buf[y], cacheINS, cacheINSs);
+			y += cacheINSs;
+			SW1SW2 = 0x9000;
+			break;
+		}
+		case 0xCA00: { // trace level, P2: 0 off, 1 errors, 2 APDUs, 3 T=1' blocks, FF query only. Returns the level
+			// before and the records lost so far.
+			const uint8_t level = P1P2 & 0xFF;
+			if (level > 3 && level != 0xFF) {
+				SW1SW2 = 0x6A86;
+				break;
+			}
+			const uint32_t lost = seccid::trace.losses();
+			buf[y++] = seccid::trace.level;
+			buf[y++] = lost >> 24;
+			buf[y++] = lost >> 16;
+			buf[y++] = lost >> 8;
+			buf[y++] = lost;
+			if (level != 0xFF)
+				seccid::trace.level = level;
+			SW1SW2 = 0x9000;
+			break;
+		}
 		default: // call SE otherweise
-			return callSE(buf, len);
+			return callSE(s, buf, len, apdu);
 		}
 	} else {
-		return callSE(buf, len);
+		return callSE(s, buf, len, apdu);
 	}
 
 	buf[y++] = SW1SW2 >> 8;
@@ -180,20 +869,111 @@ uint32_t process(uint8_t *buf, uint32_t len) {
 	return y;
 }
 
-uint32_t callSE(uint8_t *buf, uint32_t len) {
-	if (se1) {
-		// XXX: handle extended length
-		uint32_t lc = (len > 4) ? buf[4] : 0, le = (len > 4) ? buf[5 + lc] : 0; // last byte of command
+void prefetch() {
+	if (!SE_RANDOM_POOL || randLane < 0 || SE_RANDOM_POOL - (randHead - randTail) < randChunk)
+		return;
+	se_slot_t &s = seSlots[randLane];
+	if (s.state != SE_ACTIVE || s.drained || s.busy || s.held)
+		return;
+
+	uint8_t buf[256 + 2];
+	memcpy(buf, randCmd, randCmdLen);
+	s.busy = 1;
+	s.se->setWaitCallback(NULL); // the CCID layer does not know this lane is busy: no XfrBlocks in between
+	const int32_t n = s.se->T1TX(buf, randCmdLen, sizeof(buf));
+	s.se->setWaitCallback(seWait);
+	s.busy = 0;
+	s.apdus++;
+	if (n > 2 && buf[n - 2] == 0x90 && !buf[n - 1]) {
+		randPut(buf, n - 2);
+	} else { // left to the host, which gets the SW or slot error from its next FFFF C900
+		seccid::trace.event(seccid::TRACE_RANDOM_ERR, randLane, n < 2 ? n : (buf[n - 2] << 8) | buf[n - 1]);
+		if (SE_CACHE_SIZE && n < 0)
+			cacheReset(randLane);
+		if (n == T1_ERR_HW)
+			s.state = SE_ERROR;
+		randLane = -1;
+	}
+}
+
+// 6Cxx: repeat a case 2 command with Le = xx. 61xx: GET RESPONSE, the parts are concatenated in buf while they
+// fit into lo bytes, the host fetches the rest. Saves a USB round trip per part, and a pooled SE keeps its
+// response. Length of the response or T1_ERR_*.
+static int32_t getResponse(se_slot_t &s, uint8_t *buf, int32_t n, uint32_t lo, const uint8_t *hdr, const apdu_t &apdu) {
+	if (n == 2 && buf[0] == 0x6C && !apdu.nc && !apdu.ext) {
+		const uint8_t le = buf[1];
+		memcpy(buf, hdr, 4);
+		buf[4] = le;
+		n = s.se->T1TX(buf, 5, lo);
+	}
 
-		//uint32_t n = se1->T1TX(buf, len, le + 2); // add status word
-		uint32_t n = se1->T1TX(buf, 5 + lc, le + 2); // add status word
+	// class of GET RESPONSE: logical channel of the command, no chaining or secure messaging
+	const uint8_t cla = (hdr[0] & 0x80) ? 0x00 : (hdr[0] & 0x40) ? 0x40 | (hdr[0] & 0x0F) : hdr[0] & 0x03;
+	for (uint8_t part = 0; n >= 2 && buf[n - 2] == 0x61 && part < SE_GET_RESPONSE; part++) {
+		const uint32_t off = n - 2, le = buf[n - 1] ? buf[n - 1] : 256;
+		if (off + le + 2 > lo)
+			break;
+		uint8_t *cmd = &buf[off];
+		cmd[4] = cmd[1];
+		cmd[0] = cla, cmd[1] = 0xC0, cmd[2] = cmd[3] = 0;
+		const int32_t m = s.se->T1TX(cmd, 5, lo - off);
+		if (m < 0)
+			return m;
+		n = off + m;
+	}
+	return n;
+}
+
+// APDU of len bytes in buf replaced by its response of at most lo bytes, -CCID slot error on failure
+uint32_t callSE(se_slot_t &s, uint8_t *buf, uint32_t len, apdu_t &apdu, uint32_t lo) {
+	const uint8_t lane = &s - seSlots;
+	if (s.state == SE_CIP || s.state == SE_SUSPENDED) { // attached by the next APDU
+		bool cold;
+		seAttach(lane, cold);
+		if (cold)
+			updateSlots(lane); // reset on the way, the host's card session is lost
+	}
+	if (s.state == SE_ACTIVE || s.state == SE_ERROR) {
+		if (apdu.ext && apdu.ne > lo - 2) { // limit extended Le to what fits into one CCID message
+			buf[len - 2] = (lo - 2) >> 8;
+			buf[len - 1] = (lo - 2) & 0xFF;
+		}
+
+		cache_op_t op;
+		if (SE_CACHE_SIZE && cacheFind(lane, buf, len, apdu, lo, op)) // without touching the bus
+			return lo;
+
+		uint8_t hdr[4];
+		memcpy(hdr, buf, sizeof(hdr));
+		s.busy = 1;
+		int32_t n = s.se->T1TX(buf, len, lo); // response replaces command
+		if (SE_GET_RESPONSE && n >= 2)
+			n = getResponse(s, buf, n, lo, hdr, apdu);
+		if (SE_CACHE_SIZE)
+			cacheStore(lane, buf, n, op);
+		s.busy = 0;
+		s.apdus++;
+		// chained, 61xx to fetch, or a GET CHALLENGE the host may authenticate against next
+		s.held = n >= 2 && hdr[0] != 0xFF && ((hdr[0] & 0x10) || buf[n - 2] == 0x61 || hdr[1] == 0x84);
+		if (n == T1_ERR_ABORTED) { // by the host, not a fault of the SE
+			seccid::trace.event(seccid::TRACE_ABORT, lane, apdu.nc);
+			return -CMD_ABORTED;
+		}
+		if (n < 0) { // reported as slot error, a member failing repeatedly or beyond recovery leaves the pool
+			s.drained |= ++s.fails >= SE_POOL_FAILS || n == T1_ERR_HW;
+			if (n == T1_ERR_HW)
+				s.state = SE_ERROR;
+			updateSlots();
+			seccid::trace.event(seccid::TRACE_T1_ERR, lane, n);
+			return n == T1_ERR_MUTE ? -ICC_MUTE : n == T1_ERR_XFR ? -XFR_PARITY_ERROR : -HW_ERROR;
+		}
 
-		Serial.printf("> %4.4X, %4.4X, %4.4X: ", lc, le, n);
-		printHex(Serial, buf, n);
-		Serial.println();
+		s.fails = 0;
+		s.state = SE_ACTIVE;
+		seccid::trace.event(seccid::TRACE_RSP, lane, n >= 2 ? (buf[n - 2] << 8) | buf[n - 1] : -1, buf, n);
 
 		return n;
 	} else {
-		return -2;
+		return -ICC_MUTE;
 	}
 }
@@ -31,6 +31,21 @@
 #define USB_PID 0xE007
 #define USB_DEV 0x0100
 
-uint32_t process(uint8_t*, uint32_t);
+// decoded command APDU, ISO 7816-4 cases 1, 2S/E, 3S/E and 4S/E
+typedef struct {
+	uint16_t clains, p1p2;
+	uint32_t nc, ne; // command data length, expected response length (0: no Le, 256/65536: Le = 0)
+	uint8_t *data;
+	bool ext; // extended length encoding
+} apdu_t;
+
+bool decodeAPDU(uint8_t *buf, uint32_t len, apdu_t &apdu);
+
+void seBegin(); // core 1 at boot, during USB enumeration: status LED, SEs reset and attached
+uint32_t process(uint8_t lane, uint8_t*, uint32_t);
+int8_t dispatch(uint8_t slot, uint8_t*, uint32_t, uint32_t busyLanes); // lane of an XfrBlock, SE pool behind slot 0
+void setWaitCallback(void (*cb)(void)); // passed to each SE transport, runs other lanes while one waits
+void abortLane(uint8_t lane); // host abort, ends the exchange of that lane's SE early
+void prefetch(); // core 1 while idle: fill the random pool (FFFF C9xx)
 
 #endif
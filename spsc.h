@@ -0,0 +1,75 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * single producer / single consumer ring, lock-free between the two RP2040 cores
+ *
+ * head is written by the producer only, tail by the consumer only. Both are free
+ * running counters, N must be a power of two. Cortex-M0+ has no exclusive access
+ * instructions, aligned 32 bit loads and stores plus barriers are sufficient here.
+ */
+
+#ifndef _H_SPSC_
+#define _H_SPSC_
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace seccid {
+
+template<typename T, uint32_t N>
+class SPSC {
+	static_assert(N && !(N & (N - 1)), "ring size must be a power of two");
+
+	T items[N];
+	std::atomic<uint32_t> head { 0 }, tail { 0 };
+public:
+	bool push(const T &item) { // producer
+		const uint32_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == N)
+			return false;
+		items[h & (N - 1)] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item) { // consumer
+		const uint32_t t = tail.load(std::memory_order_relaxed);
+		if (head.load(std::memory_order_acquire) == t)
+			return false;
+		item = items[t & (N - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool peek(T &item) const { // consumer
+		const uint32_t t = tail.load(std::memory_order_relaxed);
+		if (head.load(std::memory_order_acquire) == t)
+			return false;
+		item = items[t & (N - 1)];
+		return true;
+	}
+
+	uint32_t count() const {
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * latency of the stages an XfrBlock passes, as log2 histograms in microseconds, and transport counters
+ *
+ * Each stage is recorded by one core only, the counters by core 1. A reset is requested by bumping a
+ * generation, each core clears its own part before it records the next value, so no counter has two
+ * writers. Read out and reset by FFFF C4xx.
+ */
+
+#ifndef _H_STATS_
+#define _H_STATS_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#define STAT_BUCKETS (24) // bucket b: durations of b bits, 0: below 1 us, 23: from 4.2 s on
+
+namespace seccid {
+
+// stages, the core recording them in brackets
+enum : uint8_t {
+	STAGE_HOST, // [0] last response sent to the next XfrBlock, nothing outstanding: pcscd and application
+	STAGE_USB_RX, // [0] XfrBlock header to its last payload packet
+	STAGE_QUEUE, // [1] received to executed on a lane
+	STAGE_I2C_WR, // [1] command blocks written, chained ones acknowledged
+	STAGE_SE, // [1] command sent to the first response header: execution, sleep and polling
+	STAGE_I2C_RD, // [1] response blocks read from the first header on
+	STAGE_EXEC, // [1] process(), vendor commands and cached responses included
+	STAGE_USB_TX, // [0] executed to response sent: core 0 picking it up and the IN transfer
+	STAGE_TOTAL, // [0] XfrBlock header to response sent
+	STAGES
+};
+
+// transport counters, core 1
+enum : uint8_t {
+	STAT_POLLS, // NACKed block header reads
+	STAT_WR_NACKS, // NACKed block writes
+	STAT_CRC_ERRORS, // blocks received with a bad CRC
+	STAT_RETRANSMITS, // blocks sent again or asked for again
+	STAT_WTX, // S(WTX) requests
+	STAT_RECOVERIES, // exchanges failed and recovered, or not
+	STAT_BUS_TX, // bytes written to the SEs
+	STAT_BUS_RX, // bytes of block headers, INF and CRC read from the SEs
+	STAT_COUNTERS
+};
+
+class Stats {
+	static constexpr uint8_t CORE[STAGES] = { 0, 0, 1, 1, 1, 1, 1, 0, 0 };
+
+	uint32_t hist[STAGES][STAT_BUCKETS] = { }, max[STAGES] = { }, counters[STAT_COUNTERS] = { };
+	std::atomic<uint8_t> resetReq { 0 }; // written by core 1
+	uint8_t resetDone[2] = { };
+
+	bool pending(uint8_t core) const {
+		return resetDone[core] != resetReq.load(std::memory_order_acquire);
+	}
+	void sync(uint8_t core) { // clear the part of this core once a reset was requested
+		if (!pending(core))
+			return;
+		for (uint8_t s = 0; s < STAGES; s++) {
+			if (CORE[s] == core) {
+				memset(hist[s], 0, sizeof(hist[s]));
+				max[s] = 0;
+			}
+		}
+		if (core)
+			memset(counters, 0, sizeof(counters));
+		resetDone[core] = resetReq.load(std::memory_order_relaxed);
+	}
+	static uint32_t put(uint8_t *p, uint32_t v) {
+		p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+		return 4;
+	}
+public:
+	void stage(uint8_t s, uint32_t us) {
+		sync(CORE[s]);
+		const uint8_t b = us ? 32 - __builtin_clz(us) : 0;
+		hist[s][b < STAT_BUCKETS ? b : STAT_BUCKETS - 1]++;
+		if (us > max[s])
+			max[s] = us;
+	}
+
+	void count(uint8_t c, uint32_t n = 1) {
+		sync(1);
+		counters[c] += n;
+	}
+
+	void reset() { // core 1, core 0 clears its stages when it records the next
+		resetReq.store(resetReq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		sync(1);
+	}
+
+	// counters, then max and buckets of each stage, 32 bit big endian. Returns the bytes written.
+	static constexpr uint32_t SIZE = (STAT_COUNTERS + STAGES * (1 + STAT_BUCKETS)) * 4;
+	uint32_t write(uint8_t *buf) const {
+		uint32_t y = 0;
+		for (uint8_t c = 0; c < STAT_COUNTERS; c++)
+			y += put(&buf[y], counters[c]);
+		for (uint8_t s = 0; s < STAGES; s++) {
+			const bool cleared = pending(CORE[s]); // reset requested, not yet done by core 0
+			y += put(&buf[y], cleared ? 0 : max[s]);
+			for (uint8_t b = 0; b < STAT_BUCKETS; b++)
+				y += put(&buf[y], cleared ? 0 : hist[s][b]);
+		}
+		return y;
+	}
+};
+
+extern Stats stats;
+
+} // end namespace
+
+#endif
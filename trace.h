@@ -0,0 +1,143 @@
+/*
+ * This file is part of the SECCID distribution (https://github.com/ckahlo/seccid).
+ * Copyright (c) 2023 - 2025 Christian Kahlo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * binary trace of the APDU path
+ *
+ * Core 1 writes fixed size records into an SPSC ring without formatting anything, core 0
+ * drains them from loop() to the CDC serial port whenever it has room. Each record goes out
+ * as one frame, its data cut to the bytes captured:
+ *
+ *   A5 n | us(4) id src len(2) arg(4) data(n - 12) | CRC16(2)
+ *
+ * little endian fields, CRC16 of T=1' over n and the record. Records not fitting into the
+ * ring are counted and reported by a TRACE_LOST record. host/tracedump decodes a capture,
+ * text printed in between passes through.
+ */
+
+#ifndef _H_TRACE_
+#define _H_TRACE_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <Arduino.h>
+
+#include "crc16.h"
+#include "spsc.h"
+
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS (64) // ring size, power of two
+#endif
+#ifndef TRACE_DATA
+#define TRACE_DATA (16) // leading bytes of an APDU or response captured
+#endif
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL (2) // at boot, changed by FFFF CAxx
+#endif
+#define TRACE_SYNC (0xA5)
+#define TRACE_HDR (12)
+
+namespace seccid {
+
+// events, the level that enables them in brackets
+enum : uint8_t {
+	TRACE_LOST, // [1] arg: records lost since the last report
+	TRACE_APDU, // [2] src: lane, data: command, arg: Nc
+	TRACE_RSP, // [2] src: lane, data: response, arg: SW
+	TRACE_ABORT, // [1] src: lane, arg: Nc
+	TRACE_T1_ERR, // [1] src: lane, arg: T1_ERR_*
+	TRACE_T1_FAIL, // [1] src: I2C address, arg: 1 deadline expired | 2 command sent, no repeat
+	TRACE_T1_RECOVER, // [1] src: I2C address, arg: recovery step that failed
+	TRACE_T1_BLOCK, // [3] src: I2C address, data: NAD PCB LEN of a block received
+	TRACE_RANDOM_ERR, // [1] src: lane, arg: SW or T1_ERR_*
+	TRACE_SE_CIP, // [1] src: lane attached after a reset, data: PVER IFSC MCF MPOT BWT WUT (16 bit), arg: historical bytes
+	TRACE_SE_FAIL, // [1] src: lane, arg: state the attach ended in (0: nobody at the address)
+	TRACE_EVENTS
+};
+
+typedef struct {
+	uint32_t us;
+	uint8_t id, src;
+	uint16_t len; // of the data, the first TRACE_DATA bytes are captured
+	int32_t arg;
+	uint8_t data[TRACE_DATA];
+} trace_rec_t;
+static_assert(sizeof(trace_rec_t) == TRACE_HDR + TRACE_DATA, "trace record must not be padded");
+
+class Trace {
+	SPSC<trace_rec_t, TRACE_RECORDS> ring;
+	std::atomic<uint32_t> lost { 0 };
+	uint32_t reported = 0; // core 0
+public:
+	static constexpr uint8_t LEVELS[TRACE_EVENTS] = { 1, 2, 2, 1, 1, 1, 1, 3, 1, 1, 1 };
+	volatile uint8_t level = TRACE_LEVEL; // 0: off
+
+	bool on(uint8_t id) const {
+		return LEVELS[id] <= level;
+	}
+
+	// producer, core 1
+	void event(uint8_t id, uint8_t src, int32_t arg, const uint8_t *data = NULL, uint32_t len = 0) {
+		if (!on(id))
+			return;
+		trace_rec_t r;
+		r.us = micros();
+		r.id = id, r.src = src;
+		r.len = len > 0xFFFF ? 0xFFFF : len;
+		r.arg = arg;
+		if (len)
+			memcpy(r.data, data, len < TRACE_DATA ? len : TRACE_DATA);
+		if (!ring.push(r))
+			lost.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint32_t losses() const {
+		return lost.load(std::memory_order_relaxed);
+	}
+
+	// consumer, core 0: up to max frames while out has room for them, returns the frames written
+	template<typename OUT>
+	uint32_t drain(OUT &out, uint32_t max) {
+		uint8_t frame[2 + TRACE_HDR + TRACE_DATA + 2];
+		uint32_t k = 0;
+		for (trace_rec_t r; k < max && out.availableForWrite() >= (int) sizeof(frame); k++) {
+			const uint32_t l = losses();
+			if (l != reported) {
+				r = { (uint32_t) micros(), TRACE_LOST, 0, 0, (int32_t) (l - reported) };
+				reported = l;
+			} else if (!ring.pop(r)) {
+				break;
+			}
+			const uint8_t n = TRACE_HDR + (r.len < TRACE_DATA ? r.len : TRACE_DATA);
+			frame[0] = TRACE_SYNC;
+			frame[1] = n;
+			memcpy(&frame[2], &r, n);
+			const uint16_t crc = CRC16<>().update(&frame[1], n + 1).final();
+			frame[2 + n] = crc >> 8;
+			frame[3 + n] = crc;
+			out.write(frame, n + 4);
+		}
+		return k;
+	}
+};
+
+extern Trace trace;
+
+} // end namespace
+
+#endif